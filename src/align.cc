@@ -1,7 +1,6 @@
 #include "cnn/cnn.h"
 #include "cnn/training.h"
 
-#include <boost/archive/text_iarchive.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/join.hpp>
 #include <boost/program_options/parsers.hpp>
@@ -10,10 +9,13 @@
 #include <iostream>
 #include <fstream>
 #include <csignal>
+#include <memory>
 
 #include "bitext.h"
 #include "attentional.h"
+#include "model_io.h"
 #include "utils.h"
+#include "inference.h"
 
 using namespace cnn;
 using namespace std;
@@ -28,16 +30,6 @@ void ctrlc_handler(int signal) {
   }
 }
 
-void trim(vector<string>& tokens, bool removeEmpty) {
-  for (unsigned i = 0; i < tokens.size(); ++i) {
-    boost::algorithm::trim(tokens[i]);
-    if (tokens[i].length() == 0 && removeEmpty) {
-      tokens.erase(tokens.begin() + i);
-      --i;
-    }
-  }
-}
-
 int main(int argc, char** argv) {
 
   namespace po = boost::program_options;
@@ -45,6 +37,7 @@ int main(int argc, char** argv) {
   po::options_description opts("Allowed options");
   opts.add_options()
     ("help","TODO...")
+    ("forward_only", "align with the forward-only engine (see inference.h) instead of a computation graph")
     ;
   po::store(po::parse_command_line(argc, argv, opts), vm);
   po::notify(vm);
@@ -57,26 +50,20 @@ int main(int argc, char** argv) {
   signal (SIGINT, ctrlc_handler);
 
   const string model_filename = argv[1];
-  ifstream model_file(model_filename);
-  if (!model_file.is_open()) {
-    cerr << "ERROR: Unable to open " << model_filename << endl;
-    exit(1);
-  }
-  boost::archive::text_iarchive ia(model_file);
-
   cnn::Initialize(argc, argv);
   Dict source_vocab;
   Dict target_vocab;
-  ia & source_vocab;
-  ia & target_vocab;
-  source_vocab.Freeze();
-  target_vocab.Freeze();
-
   Model model;
   AttentionalModel attentional_model;
-  ia & attentional_model;
-  attentional_model.Initialize(model, source_vocab.size(), target_vocab.size());
-  ia & model;
+  if (!LoadModel(model_filename, source_vocab, target_vocab, attentional_model, model)) {
+    cerr << "ERROR: Unable to open " << model_filename << endl;
+    exit(1);
+  }
+
+  unique_ptr<InferenceModel> inference_model;
+  if (vm.count("forward_only")) {
+    inference_model.reset(new InferenceModel(attentional_model));
+  }
 
   WordId ksBOS = source_vocab.Convert("<s>");
   WordId ksEOS = source_vocab.Convert("</s>");
@@ -84,38 +71,38 @@ int main(int argc, char** argv) {
   WordId ktEOS = target_vocab.Convert("</s>");
 
   string line;
+  vector<boost::string_ref> parts;
+  vector<boost::string_ref> source_tokens;
+  vector<boost::string_ref> target_tokens;
+  vector<WordId> source;
+  vector<WordId> target;
   for (; getline(cin, line);) {
-    vector<string> parts = tokenize(line, "|||");
-    trim(parts, false);
-
-    vector<string> source_tokens = tokenize(parts[0], " ");
-    trim(source_tokens, true);
-
-    vector<WordId> source(source_tokens.size() + 2);
-    source[0] = ksBOS;
-    for (unsigned i = 0; i < source_tokens.size(); ++i) {
-      source[i + 1] = source_vocab.Convert(source_tokens[i]);
+    split_fields(line, "|||", &parts);
+    if (parts.size() < 2) {
+      cerr << "ERROR: Expected a source and a target sentence separated by |||: " << line << endl;
+      exit(1);
     }
-    source[source_tokens.size() + 1] = ksEOS;
 
-    vector<string> target_tokens = tokenize(parts[1], " ");
-    trim(target_tokens, true);
+    split_words(parts[0], &source_tokens);
+    source.clear();
+    source.push_back(ksBOS);
+    convert_words(source_tokens, source_vocab, &source);
+    source.push_back(ksEOS);
 
-    vector<WordId> target(target_tokens.size() + 2);
-    target[0] = ktBOS;
-    for (unsigned i = 0; i < target_tokens.size(); ++i) {
-      target[i + 1] = target_vocab.Convert(target_tokens[i]);
-    }
-    target[target_tokens.size() + 1] = ktEOS;
+    split_words(parts[1], &target_tokens);
+    target.clear();
+    target.push_back(ktBOS);
+    convert_words(target_tokens, target_vocab, &target);
+    target.push_back(ktEOS);
 
-    cout << boost::algorithm::join(source_tokens, " ") << endl;
-    cout << boost::algorithm::join(target_tokens, " ") << endl;
+    cout << join_words(source_tokens) << endl;
+    cout << join_words(target_tokens) << endl;
 
     assert (source[0] == ksBOS);
     assert (source[source.size() - 1] == ksEOS);
     assert (target[0] == ktBOS);
     assert (target[target.size() - 1] == ktEOS);
-    vector<vector<float> > alignment = attentional_model.Align(source, target);
+    vector<vector<float> > alignment = inference_model ? inference_model->Align(source, target) : attentional_model.Align(source, target);
     unsigned j = 0;
     for (vector<float> v : alignment) {
       for (unsigned i = 0; i < v.size(); ++i) {
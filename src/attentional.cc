@@ -6,6 +6,7 @@
 
 #include "bitext.h"
 #include "attentional.h"
+#include "partial_softmax.h"
 
 using namespace std;
 using namespace cnn;
@@ -22,9 +23,41 @@ void AttentionalModel::SetParams(boost::program_options::variables_map vm){
   final_hidden_dim = vm["final_hidden_dim"].as<unsigned>();
 }
 
+void AttentionalModel::SetTrainingObjective(const string& type, unsigned negative_samples, const vector<double>& target_counts) {
+  if (type != "full" && type != "sampled" && type != "nce") {
+    cerr << "ERROR: Unknown softmax type " << type << ", expected full, sampled or nce" << endl;
+    exit(1);
+  }
+  softmax_type = type;
+  this->negative_samples = negative_samples;
+  if (softmax_type == "full") {
+    return;
+  }
+  if (negative_samples == 0) {
+    cerr << "ERROR: The " << softmax_type << " softmax needs at least one negative sample" << endl;
+    exit(1);
+  }
+
+  noise_distribution = discrete_distribution<unsigned>(target_counts.begin(), target_counts.end());
+  const vector<double> probabilities = noise_distribution.probabilities();
+  noise_log_probs.resize(probabilities.size());
+  for (unsigned w = 0; w < probabilities.size(); ++w) {
+    // Words that never occur as targets are never scored, the floor only keeps the log finite
+    noise_log_probs[w] = log(max(probabilities[w], 1e-30));
+  }
+  candidate_words.clear();
+  candidate_positions.assign(probabilities.size(), -1);
+}
+
+void AttentionalModel::SeedNoise(const vector<unsigned>& values) {
+  seed_seq seed(values.begin(), values.end());
+  noise_rng.seed(seed);
+}
+
 void AttentionalModel::Initialize(Model& model, unsigned src_vocab_size, unsigned tgt_vocab_size) {
 
   GetParams();
+  InitializeAlignerColumns();
   forward_builder = LSTMBuilder(lstm_layer_count, embedding_dim, half_annotation_dim, &model);
   reverse_builder = LSTMBuilder(lstm_layer_count, embedding_dim, half_annotation_dim, &model);
   output_builder = LSTMBuilder(lstm_layer_count, embedding_dim + 2 * half_annotation_dim, output_state_dim, &model);
@@ -44,6 +77,90 @@ void AttentionalModel::Initialize(Model& model, unsigned src_vocab_size, unsigne
   p_fOb = model.add_parameters({tgt_vocab_size});
 }
 
+void AttentionalModel::InitializeAlignerColumns() {
+  aligner_state_cols.resize(output_state_dim);
+  for (unsigned i = 0; i < output_state_dim; ++i) {
+    aligner_state_cols[i] = i;
+  }
+  aligner_annotation_cols.resize(2 * half_annotation_dim);
+  for (unsigned i = 0; i < 2 * half_annotation_dim; ++i) {
+    aligner_annotation_cols[i] = output_state_dim + i;
+  }
+}
+
+// cnn only creates parameters through a Model, which allocates and randomly initializes
+// them. Mapped parameters are placeholders of one value each, pointed at their block with
+// their real dimensions.
+static void BindParameters(Parameters* p, const Dim& d, float* values) {
+  p->dim = d;
+  p->values.d = d;
+  p->values.v = values;
+}
+
+static void BindLookupParameters(LookupParameters* p, unsigned n, const Dim& d, float* values) {
+  Tensor row = p->values[0];
+  row.d = d;
+  p->dim = d;
+  p->values.assign(n, row);
+  for (unsigned i = 0; i < n; ++i) {
+    p->values[i].v = values + i * d.size();
+  }
+}
+
+// The parameters of each layer in the order LSTMBuilder adds them: x2i, h2i, c2i, bi,
+// x2o, h2o, c2o, bo, x2c, h2c, bc
+static void BindLSTM(LSTMBuilder& builder, unsigned input_dim, unsigned hidden_dim, const vector<float*>& blocks, unsigned* next) {
+  const long H = hidden_dim;
+  for (unsigned l = 0; l < builder.params.size(); ++l) {
+    const long I = (l == 0) ? input_dim : hidden_dim;
+    const vector<Dim> dims = {{H, I}, {H, H}, {H, H}, {H}, {H, I}, {H, H}, {H, H}, {H}, {H, I}, {H, H}, {H}};
+    assert (builder.params[l].size() == dims.size());
+    for (unsigned i = 0; i < dims.size(); ++i) {
+      BindParameters(builder.params[l][i], dims[i], blocks[(*next)++]);
+    }
+  }
+}
+
+bool AttentionalModel::InitializeMapped(Model& model, unsigned src_vocab_size, unsigned tgt_vocab_size, const vector<float*>& blocks) {
+  GetParams();
+  InitializeAlignerColumns();
+  const unsigned lstm_parameter_count = 3 * lstm_layer_count * 11;
+  if (blocks.size() != lstm_parameter_count + 10 + 2) {
+    return false;
+  }
+
+  // Same order as Initialize
+  unsigned next = 0;
+  forward_builder = LSTMBuilder(lstm_layer_count, 1, 1, &model);
+  reverse_builder = LSTMBuilder(lstm_layer_count, 1, 1, &model);
+  output_builder = LSTMBuilder(lstm_layer_count, 1, 1, &model);
+  BindLSTM(forward_builder, embedding_dim, half_annotation_dim, blocks, &next);
+  BindLSTM(reverse_builder, embedding_dim, half_annotation_dim, blocks, &next);
+  BindLSTM(output_builder, embedding_dim + 2 * half_annotation_dim, output_state_dim, blocks, &next);
+
+  auto add = [&](const Dim& d) {
+    Parameters* p = model.add_parameters({1});
+    BindParameters(p, d, blocks[next++]);
+    return p;
+  };
+  p_aIH = add({alignment_hidden_dim, output_state_dim + 2 * half_annotation_dim});
+  p_aHb = add({alignment_hidden_dim, 1});
+  p_aHO = add({1, alignment_hidden_dim});
+  p_aOb = add({1, 1});
+  p_Ws = add({2 * half_annotation_dim, half_annotation_dim});
+  p_bs = add({2 * half_annotation_dim});
+  p_fIH = add({final_hidden_dim, embedding_dim + 2 * half_annotation_dim + output_state_dim});
+  p_fHb = add({final_hidden_dim});
+  p_fHO = add({tgt_vocab_size, final_hidden_dim});
+  p_fOb = add({tgt_vocab_size});
+
+  p_Es = model.add_lookup_parameters(1, {1});
+  BindLookupParameters(p_Es, src_vocab_size, {embedding_dim}, blocks[next++]);
+  p_Et = model.add_lookup_parameters(1, {1});
+  BindLookupParameters(p_Et, tgt_vocab_size, {embedding_dim}, blocks[next++]);
+  return true;
+}
+
 vector<Expression> AttentionalModel::BuildForwardAnnotations(const vector<WordId>& sentence, ComputationGraph& cg) {
   forward_builder.new_graph(cg);
   forward_builder.start_new_sequence();
@@ -69,7 +186,46 @@ vector<Expression> AttentionalModel::BuildReverseAnnotations(const vector<WordId
   return reverse_annotations;
 }
 
-vector<Expression> AttentionalModel::BuildAnnotationVectors(const vector<Expression>& forward_annotations, const vector<Expression>& reverse_annotations, ComputationGraph& cg) {
+// Minibatch versions of the above. All sentences must have the same length;
+// element i of the batch is sentences[i].
+vector<Expression> AttentionalModel::BuildForwardAnnotations(const vector<vector<WordId> >& sentences, ComputationGraph& cg) {
+  forward_builder.new_graph(cg);
+  forward_builder.start_new_sequence();
+  const unsigned length = sentences[0].size();
+  vector<Expression> forward_annotations(length);
+  vector<unsigned> words(sentences.size());
+  for (unsigned t = 0; t < length; ++t) {
+    for (unsigned i = 0; i < sentences.size(); ++i) {
+      assert (sentences[i].size() == length);
+      words[i] = sentences[i][t];
+    }
+    Expression i_x_t = lookup(cg, p_Es, words);
+    Expression i_y_t = forward_builder.add_input(i_x_t);
+    forward_annotations[t] = i_y_t;
+  }
+  return forward_annotations;
+}
+
+vector<Expression> AttentionalModel::BuildReverseAnnotations(const vector<vector<WordId> >& sentences, ComputationGraph& cg) {
+  reverse_builder.new_graph(cg);
+  reverse_builder.start_new_sequence();
+  const unsigned length = sentences[0].size();
+  vector<Expression> reverse_annotations(length);
+  vector<unsigned> words(sentences.size());
+  for (unsigned t = length; t > 0; ) {
+    t--;
+    for (unsigned i = 0; i < sentences.size(); ++i) {
+      assert (sentences[i].size() == length);
+      words[i] = sentences[i][t];
+    }
+    Expression i_x_t = lookup(cg, p_Es, words);
+    Expression i_y_t = reverse_builder.add_input(i_x_t);
+    reverse_annotations[t] = i_y_t;
+  }
+  return reverse_annotations;
+}
+
+vector<Expression> AttentionalModel::BuildAnnotationVectors(const vector<Expression>& forward_annotations, const vector<Expression>& reverse_annotations) {
   vector<Expression> annotations(forward_annotations.size());
   for (unsigned t = 0; t < forward_annotations.size(); ++t) {
     const Expression& i_f = forward_annotations[t];
@@ -80,39 +236,56 @@ vector<Expression> AttentionalModel::BuildAnnotationVectors(const vector<Express
   return annotations;
 }
 
+AttentionCache AttentionalModel::BuildAttentionCache(const vector<Expression>& annotations, const MLP& aligner) {
+  // aIH's columns are laid out as [state; annotation], matching the original concatenated input.
+  // Slicing the parameter (rather than storing two) keeps existing model files loadable.
+  Expression i_state_IH = select_cols(aligner.i_IH, aligner_state_cols);
+  Expression i_annotation_IH = select_cols(aligner.i_IH, aligner_annotation_cols);
+
+  AttentionCache attention;
+  attention.annotation_matrix = concatenate_cols(annotations);
+  attention.annotation_projection = i_annotation_IH * attention.annotation_matrix;
+  attention.i_state_IH = i_state_IH;
+  return attention;
+}
+
 OutputState AttentionalModel::GetNextOutputState(const Expression& prev_context, const Expression& prev_target_word_embedding,
-    const vector<Expression>& annotations, const MLP& aligner, ComputationGraph& cg, vector<float>* out_alignment) {
-  const unsigned source_size = annotations.size();
+    const AttentionCache& attention, const MLP& aligner, ComputationGraph& cg, vector<float>* out_alignment) {
+  return GetNextOutputState(output_builder.state(), prev_context, prev_target_word_embedding, attention, aligner, cg, out_alignment);
+}
 
+OutputState AttentionalModel::GetNextOutputState(const RNNPointer& prev_state, const Expression& prev_context, const Expression& prev_target_word_embedding,
+    const AttentionCache& attention, const MLP& aligner, ComputationGraph& cg, vector<float>* out_alignment) {
   Expression state_rnn_input = concatenate({prev_context, prev_target_word_embedding});
-  Expression new_state = output_builder.add_input(state_rnn_input); // new_state = RNN(prev_state, prev_context, prev_target_word)
-  vector<Expression> unnormalized_alignments(source_size); // e_ij
+  Expression new_state = output_builder.add_input(prev_state, state_rnn_input); // new_state = RNN(prev_state, prev_context, prev_target_word)
 
-  for (unsigned s = 0; s < source_size; ++s) {
-    double prior = 1.0;
-    Expression a_input = concatenate({new_state, annotations[s]});
-    Expression a_hidden1 = affine_transform({aligner.i_Hb, aligner.i_IH, a_input});
-    Expression a_hidden2 = tanh(a_hidden1);
-    Expression a_output = affine_transform({aligner.i_Ob, aligner.i_HO, a_hidden2});
-    unnormalized_alignments[s] = a_output * prior;
-  }
+  // Run the alignment MLP over all source positions at once: column j of a_hidden
+  // is the hidden layer for annotation h_j, with the state half added to every column.
+  Expression state_projection = affine_transform({aligner.i_Hb, attention.i_state_IH, new_state});
+  Expression a_hidden1 = colwise_add(attention.annotation_projection, state_projection);
+  Expression a_hidden2 = tanh(a_hidden1);
+  Expression a_output = colwise_add(aligner.i_HO * a_hidden2, aligner.i_Ob);
+  Expression unnormalized_alignment_vector = transpose(a_output); // e_ij
 
-  Expression unnormalized_alignment_vector = concatenate(unnormalized_alignments);
   Expression normalized_alignment_vector = softmax(unnormalized_alignment_vector); // \alpha_ij
   if (out_alignment != NULL) {
-    *out_alignment = as_vector(cg.forward());
+    *out_alignment = as_vector(cg.incremental_forward());
   }
-  Expression annotation_matrix = concatenate_cols(annotations); // \alpha
-  Expression context = annotation_matrix * normalized_alignment_vector; // c = \alpha * h
+  Expression context = attention.annotation_matrix * normalized_alignment_vector; // c = \alpha * h
 
   OutputState os;
   os.state = new_state;
   os.context = context;
+  os.rnn_pointer = output_builder.state();
   return os;
 }
 
 Expression AttentionalModel::ComputeOutputDistribution(const WordId prev_word, const Expression state, const Expression context, const MLP& final, ComputationGraph& cg) {
   Expression prev_target_embedding = lookup(cg, p_Et, prev_word);
+  return ComputeOutputDistribution(prev_target_embedding, state, context, final);
+}
+
+Expression AttentionalModel::ComputeOutputDistribution(const Expression& prev_target_embedding, const Expression state, const Expression context, const MLP& final) {
   Expression final_input = concatenate({prev_target_embedding, state, context});
   Expression final_hidden1 = affine_transform({final.i_Hb, final.i_IH, final_input}); 
   Expression final_hidden2 = tanh({final_hidden1});
@@ -120,14 +293,32 @@ Expression AttentionalModel::ComputeOutputDistribution(const WordId prev_word, c
   return final_output;
 }
 
-vector<vector<float> > AttentionalModel::Align(const vector<WordId>& source, const vector<WordId>& target) {
-  ComputationGraph cg;
-  output_builder.new_graph(cg);
-  output_builder.start_new_sequence();
+// Scores several (prev_word, state, context) triples at once. Each triple is one column of the
+// final MLP's input, so the hidden->output layer runs as a single matrix-matrix product.
+// Returns a matrix of unnormalized scores with one column per triple and one row per row of
+// final.i_HO, i.e. tgt_vocab_size rows unless the output layer has been shortlisted.
+Expression AttentionalModel::ComputeOutputDistributions(const vector<WordId>& prev_words, const vector<Expression>& states, const vector<Expression>& contexts, const MLP& final, ComputationGraph& cg) {
+  assert (prev_words.size() == states.size());
+  assert (prev_words.size() == contexts.size());
+  vector<Expression> final_inputs(prev_words.size());
+  for (unsigned i = 0; i < prev_words.size(); ++i) {
+    Expression prev_target_embedding = lookup(cg, p_Et, prev_words[i]);
+    final_inputs[i] = concatenate({prev_target_embedding, states[i], contexts[i]});
+  }
+  Expression final_input_matrix = concatenate_cols(final_inputs);
+  Expression final_hidden1 = colwise_add(final.i_IH * final_input_matrix, final.i_Hb);
+  Expression final_hidden2 = tanh(final_hidden1);
+  Expression final_output = colwise_add(final.i_HO * final_hidden2, final.i_Ob);
+  return final_output;
+}
 
+// Runs the encoder over source and precomputes everything about it the decoder reads
+// at every step. Decoders only ever add nodes after these, so they can be called any
+// number of times on the result without rerunning the encoder.
+EncodedSource AttentionalModel::Encode(const vector<WordId>& source, ComputationGraph& cg) {
   vector<Expression> forward_annotations = BuildForwardAnnotations(source, cg);
   vector<Expression> reverse_annotations = BuildReverseAnnotations(source, cg);
-  vector<Expression> annotations = BuildAnnotationVectors(forward_annotations, reverse_annotations, cg);
+  vector<Expression> annotations = BuildAnnotationVectors(forward_annotations, reverse_annotations);
 
   Expression i_aIH = parameter(cg, p_aIH);
   Expression i_aHb = parameter(cg, p_aHb);
@@ -144,18 +335,33 @@ vector<vector<float> > AttentionalModel::Align(const vector<WordId>& source, con
   Expression i_bs = parameter(cg, p_bs);
   Expression i_Ws = parameter(cg, p_Ws);
 
-  vector<Expression> output_states(target.size());
-  vector<Expression> contexts(target.size());
-
+  // TODO: Verify that this crap corresponds to the comment in BuildGraph and is sane
   Expression zeroth_context_untransformed = affine_transform({i_bs, i_Ws, reverse_annotations[0]});
-  Expression zeroth_context = tanh(zeroth_context_untransformed);
-  Expression prev_context = zeroth_context;
 
+  EncodedSource encoded;
+  encoded.attention = BuildAttentionCache(annotations, aligner);
+  encoded.zeroth_context = tanh(zeroth_context_untransformed);
+  encoded.aligner = aligner;
+  encoded.final = final;
+  return encoded;
+}
+
+vector<vector<float> > AttentionalModel::Align(const vector<WordId>& source, const vector<WordId>& target) {
+  ComputationGraph cg;
+  EncodedSource encoded = Encode(source, cg);
+  return Align(encoded, target, cg);
+}
+
+vector<vector<float> > AttentionalModel::Align(const EncodedSource& encoded, const vector<WordId>& target, ComputationGraph& cg) {
+  output_builder.new_graph(cg);
+  output_builder.start_new_sequence();
+
+  Expression prev_context = encoded.zeroth_context;
   vector<vector<float> > alignment;
   for (unsigned t = 1; t < target.size() + 1; ++t) {
     vector<float> a;
     Expression prev_target_word_embedding = lookup(cg, p_Et, target[t - 1]);
-    OutputState os = GetNextOutputState(prev_context, prev_target_word_embedding, annotations, aligner, cg, &a);
+    OutputState os = GetNextOutputState(prev_context, prev_target_word_embedding, encoded.attention, encoded.aligner, cg, &a);
     prev_context = os.context;
     alignment.push_back(a);
   }
@@ -163,188 +369,288 @@ vector<vector<float> > AttentionalModel::Align(const vector<WordId>& source, con
 }
 
 vector<WordId> AttentionalModel::Translate(const vector<WordId>& source, WordId kSOS, WordId kEOS, unsigned beam_size, unsigned max_length) {
-  KBestList<vector<WordId> > kbest = TranslateKBest(source, kSOS, kEOS, 1, beam_size, max_length);
-  return kbest.hypothesis_list().begin()->second;
+  ComputationGraph cg;
+  EncodedSource encoded = Encode(source, cg);
+  return Translate(encoded, kSOS, kEOS, beam_size, max_length, cg);
 }
 
-KBestList<vector<WordId> > AttentionalModel::TranslateKBest(const vector<WordId>& source, WordId kSOS, WordId kEOS, unsigned k, unsigned beam_size, unsigned max_length) {
-  ComputationGraph cg;
-  output_builder.new_graph(cg);
+vector<WordId> AttentionalModel::Translate(const EncodedSource& encoded, WordId kSOS, WordId kEOS, unsigned beam_size, unsigned max_length, ComputationGraph& cg) {
+  KBestList<vector<WordId> > kbest = TranslateKBest(encoded, kSOS, kEOS, 1, beam_size, max_length, cg);
+  return kbest.hypothesis_list().begin()->second;
+}
 
-  vector<Expression> forward_annotations = BuildForwardAnnotations(source, cg);
-  vector<Expression> reverse_annotations = BuildReverseAnnotations(source, cg);
-  vector<Expression> annotations = BuildAnnotationVectors(forward_annotations, reverse_annotations, cg);
+KBestList<vector<WordId> > AttentionalModel::TranslateKBest(const vector<WordId>& source, WordId kSOS, WordId kEOS, unsigned k, unsigned beam_size, unsigned max_length,
+    const vector<unsigned>* shortlist) {
+  vector<KBestList<vector<WordId> > > kbest = TranslateKBest(vector<vector<WordId> >(1, source), kSOS, kEOS, k, beam_size, max_length, shortlist);
+  return kbest[0];
+}
 
-  Expression i_aIH = parameter(cg, p_aIH);
-  Expression i_aHb = parameter(cg, p_aHb);
-  Expression i_aHO = parameter(cg, p_aHO);
-  Expression i_aOb = parameter(cg, p_aOb);
-  MLP aligner = {i_aIH, i_aHb, i_aHO, i_aOb};
+KBestList<vector<WordId> > AttentionalModel::TranslateKBest(const EncodedSource& encoded, WordId kSOS, WordId kEOS, unsigned k, unsigned beam_size, unsigned max_length,
+    ComputationGraph& cg, const vector<unsigned>* shortlist) {
+  vector<KBestList<vector<WordId> > > kbest = TranslateKBest(vector<EncodedSource>(1, encoded), kSOS, kEOS, k, beam_size, max_length, cg, shortlist);
+  return kbest[0];
+}
 
-  Expression i_fIH = parameter(cg, p_fIH);
-  Expression i_fHb = parameter(cg, p_fHb);
-  Expression i_fHO = parameter(cg, p_fHO);
-  Expression i_fOb = parameter(cg, p_fOb);
-  MLP final = {i_fIH, i_fHb, i_fHO, i_fOb};
+vector<KBestList<vector<WordId> > > AttentionalModel::TranslateKBest(const vector<vector<WordId> >& sources, WordId kSOS, WordId kEOS, unsigned k, unsigned beam_size, unsigned max_length,
+    const vector<unsigned>* shortlist) {
+  ComputationGraph cg;
+  vector<EncodedSource> encoded(sources.size());
+  for (unsigned n = 0; n < sources.size(); ++n) {
+    encoded[n] = Encode(sources[n], cg);
+  }
+  return TranslateKBest(encoded, kSOS, kEOS, k, beam_size, max_length, cg, shortlist);
+}
 
-  Expression i_bs = parameter(cg, p_bs);
-  Expression i_Ws = parameter(cg, p_Ws);
+// Runs one beam search per source sentence, all in lockstep in a single graph, so that
+// every live hypothesis of every sentence is scored by the same batched output layer.
+vector<KBestList<vector<WordId> > > AttentionalModel::TranslateKBest(const vector<EncodedSource>& encoded, WordId kSOS, WordId kEOS, unsigned k, unsigned beam_size, unsigned max_length,
+    ComputationGraph& cg, const vector<unsigned>* shortlist) {
+  assert (encoded.size() > 0);
+  output_builder.new_graph(cg);
 
-  Expression zeroth_context_untransformed = affine_transform({i_bs, i_Ws, reverse_annotations[0]});
-  Expression zeroth_context = tanh(zeroth_context_untransformed);
-  /* Up until here this is all boiler plate */
+  // Every source has its own handles to the same parameters, so any will do
+  MLP final = encoded[0].final;
+  if (shortlist != NULL) {
+    // Gather the shortlisted rows of the output layer into a contiguous matrix once,
+    // so every step only scores those words. Row r of the logits is word (*shortlist)[r].
+    final.i_HO = select_rows(final.i_HO, *shortlist);
+    final.i_Ob = select_rows(final.i_Ob, *shortlist);
+  }
+  const unsigned sentence_count = encoded.size();
 
-  KBestList<vector<WordId> > completed_hyps(k);
-  KBestList<vector<WordId> > top_hyps(beam_size);
+  // Hypotheses are indices into the arena of nodes. Full word sequences are only
+  // built at the end, for the hypotheses in the k-best lists.
+  vector<HypothesisNode> arena;
+  vector<KBestList<unsigned> > completed_hyps(sentence_count, KBestList<unsigned>(k));
+  vector<KBestList<unsigned> > top_hyps(sentence_count, KBestList<unsigned>(beam_size));
   assert(k<=beam_size);
-  top_hyps.add(0.0, {});
+
+  // Each hypothesis carries the decoder state reached after reading its last word,
+  // so extending it costs a single step of the output RNN.
+  // Every sentence starts from the empty state: adding an input moves the builder's
+  // head, so output_builder.state() would chain each sentence onto the one before.
+  output_builder.start_new_sequence();
+  const RNNPointer initial_state = output_builder.state();
+  Expression sos_embedding = lookup(cg, p_Et, kSOS);
+  for (unsigned n = 0; n < sentence_count; ++n) {
+    HypothesisNode initial_hyp(-1, kSOS, 0, 0.0);
+    initial_hyp.os = GetNextOutputState(initial_state, encoded[n].zeroth_context, sos_embedding, encoded[n].attention, encoded[n].aligner, cg);
+    top_hyps[n].add(0.0, arena.size());
+    arena.push_back(initial_hyp);
+  }
 
   // Invariant: each element in top_hyps should have a length of "length"
   for (unsigned length = 0; length < max_length; ++length) {
-    KBestList<vector<WordId> > new_hyps(beam_size);
-    for (auto scored_hyp : top_hyps.hypothesis_list()) {
-      double score = scored_hyp.first;
-      vector<WordId>& hyp = scored_hyp.second;
-      assert (hyp.size() == length);
-
-      // XXX: Rebuild the whole output state sequence
-      output_builder.start_new_sequence(); 
-      Expression previous_target_word_embedding = lookup(cg, p_Et, kSOS);
-      OutputState os = GetNextOutputState(zeroth_context, previous_target_word_embedding, annotations, aligner, cg);
-      for (WordId word : hyp) {
-        assert (word != kEOS);
-        Expression previous_target_word_embedding = lookup(cg, p_Et, word);
-        os = GetNextOutputState(os.context, previous_target_word_embedding, annotations, aligner, cg);
-      } 
-
-      // Compute, normalize, and log the output distribution
-      WordId prev_word = (hyp.size() > 0) ? hyp[hyp.size() - 1] : kSOS;
-      Expression unnormalized_output_distribution = ComputeOutputDistribution(prev_word, os.state, os.context, final, cg);
-      Expression output_distribution = softmax(unnormalized_output_distribution);
-      Expression log_output_distribution = log(output_distribution);
-      //cerr << "HG has " << cg.nodes.size() << " nodes" << endl;
-      vector<float> dist = as_vector(cg.incremental_forward());
-
-      // Take the K best-looking words
-      KBestList<WordId> best_words(beam_size);
-      for (unsigned i = 0; i < dist.size(); ++i) {
-        best_words.add(dist[i], i);
+    // Score every live hypothesis of every sentence in one batch: column c of the
+    // output matrix holds the distribution over the next word for columns[c].
+    vector<pair<unsigned, unsigned> > columns; // (sentence, node index)
+    vector<WordId> prev_words;
+    vector<Expression> states;
+    vector<Expression> contexts;
+    for (unsigned n = 0; n < sentence_count; ++n) {
+      for (const pair<double, unsigned>& scored_hyp : top_hyps[n].hypothesis_list()) {
+        const HypothesisNode& hyp = arena[scored_hyp.second];
+        assert (hyp.length == length);
+        columns.push_back(make_pair(n, scored_hyp.second));
+        prev_words.push_back((hyp.length > 0) ? hyp.word : kSOS);
+        states.push_back(hyp.os.state);
+        contexts.push_back(hyp.os.context);
       }
+    }
+    if (columns.size() == 0) {
+      break;
+    }
+    // The logits are read in place from the graph's output tensor, without a copy
+    ComputeOutputDistributions(prev_words, states, contexts, final, cg);
+    const Tensor& logits = cg.incremental_forward();
+    const unsigned vocab_size = logits.d.size() / columns.size();
+
+    // Extensions are (parent node, new word) pairs. Only the ones that survive the
+    // beam get a node and have their decoder state computed below.
+    vector<KBestList<pair<unsigned, WordId> > > extensions(sentence_count, KBestList<pair<unsigned, WordId> >(beam_size));
+    for (unsigned c = 0; c < columns.size(); ++c) {
+      unsigned n = columns[c].first;
+      unsigned h = columns[c].second;
+      double score = arena[h].score;
+
+      // Take the K best-looking words, along with the softmax normalizer
+      KBestList<WordId> best_words(beam_size);
+      float log_z = LogSumExpTopK(logits.v + c * vocab_size, vocab_size, &best_words);
 
       // For each of those K words, add it to the current hypothesis, and add the
       // resulting hyp to our kbest list, unless the new word is </s>,
       // in which case we add the new hyp to the list of completed hyps.
       for (pair<double, WordId> p : best_words.hypothesis_list()) {
-        double word_score = p.first;
-        WordId word = p.second;
-        OutputState new_state = GetNextOutputState(os.context, previous_target_word_embedding, annotations, aligner, cg);
-        output_builder.rewind_one_step();
-
-        double new_score = score + word_score;
-        vector<WordId> new_hyp = hyp;
-        new_hyp.push_back(word);
-        if (new_hyp.size() == max_length || word == kEOS) {
-          completed_hyps.add(new_score, new_hyp);
+        double new_score = score + p.first - log_z;
+        WordId word = (shortlist != NULL) ? (*shortlist)[p.second] : p.second;
+        if (length + 1 == max_length || word == kEOS) {
+          if (completed_hyps[n].accepts(new_score)) {
+            HypothesisNode new_hyp((int)h, word, length + 1, new_score);
+            completed_hyps[n].add(new_score, arena.size());
+            arena.push_back(new_hyp);
+          }
         }
         else {
-          new_hyps.add(new_score, new_hyp);
+          extensions[n].emplace(new_score, h, word);
         }
       }
     }
-    top_hyps = new_hyps;
+
+    // Advance the decoder by one step for each surviving hypothesis
+    for (unsigned n = 0; n < sentence_count; ++n) {
+      KBestList<unsigned> new_hyps(beam_size);
+      for (auto& scored_extension : extensions[n].hypothesis_list()) {
+        const unsigned parent = scored_extension.second.first;
+        WordId word = scored_extension.second.second;
+        HypothesisNode new_hyp((int)parent, word, length + 1, scored_extension.first);
+        Expression word_embedding = lookup(cg, p_Et, word);
+        new_hyp.os = GetNextOutputState(arena[parent].os.rnn_pointer, arena[parent].os.context, word_embedding, encoded[n].attention, encoded[n].aligner, cg);
+        new_hyps.add(scored_extension.first, arena.size());
+        arena.push_back(new_hyp);
+      }
+      top_hyps[n] = move(new_hyps);
+    }
   }
 
-  
-  return completed_hyps;
+  // Follow the back-pointers of the finished hypotheses to spell them out
+  vector<KBestList<vector<WordId> > > kbest(sentence_count, KBestList<vector<WordId> >(k));
+  for (unsigned n = 0; n < sentence_count; ++n) {
+    for (const pair<double, unsigned>& scored_hyp : completed_hyps[n].hypothesis_list()) {
+      vector<WordId> words(arena[scored_hyp.second].length);
+      for (int i = scored_hyp.second; arena[i].parent >= 0; i = arena[i].parent) {
+        words[arena[i].length - 1] = arena[i].word;
+      }
+      kbest[n].add(scored_hyp.first, move(words));
+    }
+  }
+  return kbest;
 }
 
 vector<WordId> AttentionalModel::SampleTranslation(const vector<WordId>& source, WordId kSOS, WordId kEOS, unsigned max_length) {
   ComputationGraph cg;
-  output_builder.new_graph(cg);
-  output_builder.start_new_sequence();
+  EncodedSource encoded = Encode(source, cg);
+  return SampleTranslation(encoded, kSOS, kEOS, max_length, cg);
+}
 
-  vector<Expression> forward_annotations = BuildForwardAnnotations(source, cg);
-  vector<Expression> reverse_annotations = BuildReverseAnnotations(source, cg);
-  vector<Expression> annotations = BuildAnnotationVectors(forward_annotations, reverse_annotations, cg);
+vector<WordId> AttentionalModel::SampleTranslation(const EncodedSource& encoded, WordId kSOS, WordId kEOS, unsigned max_length, ComputationGraph& cg) {
+  return SampleTranslations(encoded, kSOS, kEOS, 1, max_length, cg)[0];
+}
 
-  Expression i_aIH = parameter(cg, p_aIH);
-  Expression i_aHb = parameter(cg, p_aHb);
-  Expression i_aHO = parameter(cg, p_aHO);
-  Expression i_aOb = parameter(cg, p_aOb);
-  MLP aligner = {i_aIH, i_aHb, i_aHO, i_aOb};
+// Draws the samples in graphs of at most max_batch_size samples each. Every graph keeps
+// the logits of all its steps alive, so this bounds memory at the cost of one encoder
+// pass per graph.
+vector<vector<WordId> > AttentionalModel::SampleTranslations(const vector<WordId>& source, WordId kSOS, WordId kEOS, unsigned count, unsigned max_length,
+    unsigned max_batch_size, vector<double>* log_probs) {
+  assert (max_batch_size > 0);
+  vector<vector<WordId> > samples;
+  if (log_probs != NULL) {
+    log_probs->clear();
+  }
+  for (unsigned done = 0; done < count; ) {
+    const unsigned batch_size = min(max_batch_size, count - done);
+    ComputationGraph cg;
+    EncodedSource encoded = Encode(source, cg);
+    vector<double> batch_log_probs;
+    vector<vector<WordId> > batch = SampleTranslations(encoded, kSOS, kEOS, batch_size, max_length, cg, &batch_log_probs);
+    for (unsigned i = 0; i < batch_size; ++i) {
+      samples.push_back(move(batch[i]));
+      if (log_probs != NULL) {
+        log_probs->push_back(batch_log_probs[i]);
+      }
+    }
+    done += batch_size;
+  }
+  return samples;
+}
 
-  Expression i_fIH = parameter(cg, p_fIH);
-  Expression i_fHb = parameter(cg, p_fHb);
-  Expression i_fHO = parameter(cg, p_fHO);
-  Expression i_fOb = parameter(cg, p_fOb);
-  MLP final = {i_fIH, i_fHb, i_fHO, i_fOb};
+// Advances all samples in lockstep, like the beam search: each step scores every
+// unfinished sample with one batched output layer, then draws each sample's next word
+// from its column. Samples drop out of the batch once they produce kEOS.
+vector<vector<WordId> > AttentionalModel::SampleTranslations(const EncodedSource& encoded, WordId kSOS, WordId kEOS, unsigned count, unsigned max_length,
+    ComputationGraph& cg, vector<double>* log_probs) {
+  output_builder.new_graph(cg);
+  output_builder.start_new_sequence();
 
-  Expression i_bs = parameter(cg, p_bs);
-  Expression i_Ws = parameter(cg, p_Ws);
+  // Every sample starts from the same state, so the first step is computed only once
+  Expression sos_embedding = lookup(cg, p_Et, kSOS);
+  OutputState initial_state = GetNextOutputState(output_builder.state(), encoded.zeroth_context, sos_embedding, encoded.attention, encoded.aligner, cg);
+  vector<OutputState> output_states(count, initial_state);
+  vector<vector<WordId> > samples(count);
+  vector<double> sample_log_probs(count, 0.0);
 
-  Expression zeroth_context_untransformed = affine_transform({i_bs, i_Ws, reverse_annotations[0]});
-  Expression zeroth_context = tanh(zeroth_context_untransformed);
-
-  Expression prev_context = zeroth_context;
-  vector<WordId> output;
-  unsigned prev_word = kSOS;
-  while (prev_word != kEOS && output.size() < max_length) {
-    Expression prev_target_word_embedding = lookup(cg, p_Et, prev_word);
-    OutputState os = GetNextOutputState(prev_context, prev_target_word_embedding, annotations, aligner, cg);
-    Expression log_output_distribution = ComputeOutputDistribution(prev_word, os.state, os.context, final, cg);
-    Expression output_distribution = softmax(log_output_distribution);
-    vector<float> dist = as_vector(cg.incremental_forward());
-    double r = rand01();
-    unsigned w = 0;
-    while (true) {
-      r -= dist[w];
-      if (r < 0.0) {
-        break;
+  vector<unsigned> live(count);
+  for (unsigned i = 0; i < count; ++i) {
+    live[i] = i;
+  }
+  vector<double> block_cdf;
+  for (unsigned length = 0; length < max_length && live.size() > 0; ++length) {
+    vector<WordId> prev_words(live.size());
+    vector<Expression> states(live.size());
+    vector<Expression> contexts(live.size());
+    for (unsigned c = 0; c < live.size(); ++c) {
+      const unsigned i = live[c];
+      prev_words[c] = (length > 0) ? samples[i].back() : kSOS;
+      states[c] = output_states[i].state;
+      contexts[c] = output_states[i].context;
+    }
+    // The logits are read in place from the graph's output tensor, without a copy
+    ComputeOutputDistributions(prev_words, states, contexts, encoded.final, cg);
+    const Tensor& logits = cg.incremental_forward();
+    const unsigned vocab_size = logits.d.size() / live.size();
+
+    vector<unsigned> still_live;
+    for (unsigned c = 0; c < live.size(); ++c) {
+      const unsigned i = live[c];
+      float log_prob;
+      WordId w = SampleFromLogits(logits.v + c * vocab_size, vocab_size, rand01(), &block_cdf, &log_prob);
+      samples[i].push_back(w);
+      sample_log_probs[i] += log_prob;
+      if (w != kEOS) {
+        still_live.push_back(i);
       }
-      ++w;
     }
-    output.push_back(w);
-    prev_word = w;
-    prev_context = os.context;
+
+    // Advance the decoder by one step for each sample that goes on
+    if (length + 1 < max_length) {
+      for (unsigned i : still_live) {
+        Expression word_embedding = lookup(cg, p_Et, samples[i].back());
+        output_states[i] = GetNextOutputState(output_states[i].rnn_pointer, output_states[i].context, word_embedding, encoded.attention, encoded.aligner, cg);
+      }
+    }
+    live = move(still_live);
+  }
+
+  if (log_probs != NULL) {
+    *log_probs = sample_log_probs;
   }
-  return output;
+  return samples;
 }
 
 Expression AttentionalModel::BuildGraph(const vector<WordId>& source, const vector<WordId>& target, ComputationGraph& cg) {
+  EncodedSource encoded = Encode(source, cg);
+  return BuildGraph(encoded, target, cg);
+}
+
+// The loss of target as the translation of an already encoded source
+Expression AttentionalModel::BuildGraph(const EncodedSource& encoded, const vector<WordId>& target, ComputationGraph& cg) {
   // Target should always contain at least <s> and </s>
   assert (target.size() > 2);
   output_builder.new_graph(cg);
   output_builder.start_new_sequence();
 
-  vector<Expression> forward_annotations = BuildForwardAnnotations(source, cg);
-  vector<Expression> reverse_annotations = BuildReverseAnnotations(source, cg);
-  vector<Expression> annotations = BuildAnnotationVectors(forward_annotations, reverse_annotations, cg);
-
-  Expression i_aIH = parameter(cg, p_aIH);
-  Expression i_aHb = parameter(cg, p_aHb);
-  Expression i_aHO = parameter(cg, p_aHO);
-  Expression i_aOb = parameter(cg, p_aOb);
-  MLP aligner = {i_aIH, i_aHb, i_aHO, i_aOb};
-
-  Expression i_fIH = parameter(cg, p_fIH);
-  Expression i_fHb = parameter(cg, p_fHb);
-  Expression i_fHO = parameter(cg, p_fHO);
-  Expression i_fOb = parameter(cg, p_fOb);
-  MLP final = {i_fIH, i_fHb, i_fHO, i_fOb};
-
-  Expression i_bs = parameter(cg, p_bs);
-  Expression i_Ws = parameter(cg, p_Ws);
+  MLP final = encoded.final;
+  if (softmax_type != "full") {
+    final = BuildSampledOutputLayer({target}, final, cg);
+  }
 
   vector<Expression> output_states(target.size());
   vector<Expression> contexts(target.size());
 
-  // TODO: Verify that this crap corresponds to the comment below and is sane
-  Expression zeroth_context_untransformed = affine_transform({i_bs, i_Ws, reverse_annotations[0]});
-  contexts[0] = tanh(zeroth_context_untransformed);
+  contexts[0] = encoded.zeroth_context;
 
   for (unsigned t = 1; t < target.size(); ++t) {
     Expression prev_target_word_embedding = lookup(cg, p_Et, target[t - 1]);
-    OutputState os = GetNextOutputState(contexts[t - 1], prev_target_word_embedding, annotations, aligner, cg);
+    OutputState os = GetNextOutputState(contexts[t - 1], prev_target_word_embedding, encoded.attention, encoded.aligner, cg);
     output_states[t] = os.state;
     contexts[t] = os.context;
   }
@@ -365,13 +671,157 @@ Expression AttentionalModel::BuildGraph(const vector<WordId>& source, const vect
   vector<Expression> errors(target.size() - 1);
   for (unsigned t = 1; t < target.size(); ++t) {
     Expression output_distribution = output_distributions[t - 1];
-    Expression error = pickneglogsoftmax(output_distribution, target[t]);
+    Expression error = ComputeOutputLoss(output_distribution, {(unsigned)target[t]}, cg);
+    errors[t - 1] = error;
+  }
+  Expression total_error = sum(errors);
+  return total_error;
+}
+
+// Builds the loss of a minibatch of sentence pairs as a batched expression with one
+// loss per pair. All sources must have the same length (see the bucketing in train.cc).
+// Targets may differ in length: shorter ones are padded with their final </s> and
+// the padded positions are masked out of the loss.
+Expression AttentionalModel::BuildGraph(const vector<vector<WordId> >& sources, const vector<vector<WordId> >& targets, ComputationGraph& cg) {
+  assert (sources.size() == targets.size());
+  assert (sources.size() > 0);
+  const unsigned batch_size = sources.size();
+  unsigned target_length = 0;
+  for (const vector<WordId>& target : targets) {
+    // Target should always contain at least <s> and </s>
+    assert (target.size() > 2);
+    target_length = max(target_length, (unsigned)target.size());
+  }
+
+  output_builder.new_graph(cg);
+  output_builder.start_new_sequence();
+
+  vector<Expression> forward_annotations = BuildForwardAnnotations(sources, cg);
+  vector<Expression> reverse_annotations = BuildReverseAnnotations(sources, cg);
+  vector<Expression> annotations = BuildAnnotationVectors(forward_annotations, reverse_annotations);
+
+  Expression i_aIH = parameter(cg, p_aIH);
+  Expression i_aHb = parameter(cg, p_aHb);
+  Expression i_aHO = parameter(cg, p_aHO);
+  Expression i_aOb = parameter(cg, p_aOb);
+  MLP aligner = {i_aIH, i_aHb, i_aHO, i_aOb};
+  AttentionCache attention = BuildAttentionCache(annotations, aligner);
+
+  Expression i_fIH = parameter(cg, p_fIH);
+  Expression i_fHb = parameter(cg, p_fHb);
+  Expression i_fHO = parameter(cg, p_fHO);
+  Expression i_fOb = parameter(cg, p_fOb);
+  MLP final = {i_fIH, i_fHb, i_fHO, i_fOb};
+  if (softmax_type != "full") {
+    final = BuildSampledOutputLayer(targets, final, cg);
+  }
+
+  Expression i_bs = parameter(cg, p_bs);
+  Expression i_Ws = parameter(cg, p_Ws);
+
+  Expression zeroth_context_untransformed = affine_transform({i_bs, i_Ws, reverse_annotations[0]});
+  Expression prev_context = tanh(zeroth_context_untransformed);
+
+  target_masks.resize(target_length);
+  vector<Expression> errors(target_length - 1);
+  vector<unsigned> prev_words(batch_size);
+  vector<unsigned> words(batch_size);
+  for (unsigned t = 1; t < target_length; ++t) {
+    vector<float>& mask = target_masks[t];
+    mask.resize(batch_size);
+    bool padded = false;
+    for (unsigned i = 0; i < batch_size; ++i) {
+      const vector<WordId>& target = targets[i];
+      prev_words[i] = target[min(t - 1, (unsigned)target.size() - 1)];
+      words[i] = target[min(t, (unsigned)target.size() - 1)];
+      mask[i] = (t < target.size()) ? 1.0 : 0.0;
+      padded = padded || (t >= target.size());
+    }
+
+    Expression prev_target_word_embedding = lookup(cg, p_Et, prev_words);
+    OutputState os = GetNextOutputState(prev_context, prev_target_word_embedding, attention, aligner, cg);
+    Expression output_distribution = ComputeOutputDistribution(prev_target_word_embedding, os.state, os.context, final);
+    Expression error = ComputeOutputLoss(output_distribution, words, cg);
+    if (padded) {
+      error = cwise_multiply(error, input(cg, Dim({1}, batch_size), &mask));
+    }
     errors[t - 1] = error;
+    prev_context = os.context;
   }
   Expression total_error = sum(errors);
   return total_error;
 }
 
+// Draws the negative samples of a graph and returns final with its output layer cut
+// down to the candidates: every word of the targets plus each negative, once.
+// The output layer's bias is shifted by -log(negative_samples * q(w)) so that both
+// sampled objectives can work directly on the resulting scores: for sampled softmax
+// this is the correction that makes the sampled normalizer unbiased, and for NCE the
+// resulting score is the log odds of w being data rather than noise.
+MLP AttentionalModel::BuildSampledOutputLayer(const vector<vector<WordId> >& targets, const MLP& final, ComputationGraph& cg) {
+  for (unsigned w : candidate_words) {
+    candidate_positions[w] = -1;
+  }
+  candidate_words.clear();
+  auto add_candidate = [&](unsigned w) {
+    if (candidate_positions[w] < 0) {
+      candidate_positions[w] = candidate_words.size();
+      candidate_words.push_back(w);
+    }
+  };
+
+  for (const vector<WordId>& target : targets) {
+    for (unsigned t = 1; t < target.size(); ++t) {
+      add_candidate(target[t]);
+    }
+  }
+  vector<unsigned> negatives(negative_samples);
+  for (unsigned& w : negatives) {
+    w = noise_distribution(noise_rng);
+    add_candidate(w);
+  }
+
+  negative_counts.assign(candidate_words.size(), 0.0);
+  for (unsigned w : negatives) {
+    negative_counts[candidate_positions[w]] += 1.0;
+  }
+  candidate_log_expected_counts.resize(candidate_words.size());
+  for (unsigned i = 0; i < candidate_words.size(); ++i) {
+    candidate_log_expected_counts[i] = log((double)negative_samples) + noise_log_probs[candidate_words[i]];
+  }
+
+  Expression log_expected_counts = input(cg, {(unsigned)candidate_words.size()}, &candidate_log_expected_counts);
+  MLP sampled = final;
+  sampled.i_HO = select_rows(final.i_HO, candidate_words);
+  sampled.i_Ob = select_rows(final.i_Ob, candidate_words) - log_expected_counts;
+  return sampled;
+}
+
+// Returns the training loss of words given the output layer's scores. For the sampled
+// objectives the scores must come from BuildSampledOutputLayer's layer. A single word
+// gives an unbatched loss, several words a batched one.
+Expression AttentionalModel::ComputeOutputLoss(const Expression& output_distribution, const vector<unsigned>& words, ComputationGraph& cg) {
+  if (softmax_type == "full") {
+    return (words.size() == 1) ? pickneglogsoftmax(output_distribution, words[0]) : pickneglogsoftmax(output_distribution, words);
+  }
+
+  vector<unsigned> positions(words.size());
+  for (unsigned i = 0; i < words.size(); ++i) {
+    assert (candidate_positions[words[i]] >= 0);
+    positions[i] = candidate_positions[words[i]];
+  }
+  if (softmax_type == "sampled") {
+    return (words.size() == 1) ? pickneglogsoftmax(output_distribution, positions[0]) : pickneglogsoftmax(output_distribution, positions);
+  }
+
+  // NCE: the target word should be classified as data and each negative sample as noise
+  Expression target_score = (words.size() == 1) ? pick(output_distribution, positions[0]) : pick(output_distribution, positions);
+  Expression data_term = log(logistic(target_score));
+  Expression noise_terms = log(logistic(-output_distribution));
+  Expression noise_term = transpose(input(cg, {(unsigned)negative_counts.size()}, &negative_counts)) * noise_terms;
+  return -(data_term + noise_term);
+}
+
 void AttentionalModel::GetParams() const {
   cerr << "== AttentionalModel Params == " << endl
        << " lstm_layer= " << lstm_layer_count << endl
@@ -1,4 +1,7 @@
+#pragma once
 #include <vector>
+#include <string>
+#include <random>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/program_options/variables_map.hpp>
 #include "cnn/cnn.h"
@@ -15,6 +18,9 @@ struct OutputState {
   Expression state;
   // Context is a weighted sum of annotation vectors
   Expression context;
+  // Handle to the output_builder state that produced this state,
+  // so that a decoder can later continue from here
+  RNNPointer rnn_pointer;
 };
 
 // A simple 2 layer MLP
@@ -25,30 +31,107 @@ struct MLP {
   Expression i_Ob;
 };
 
-struct PartialHypothesis {
-  vector<WordId> hyp;
-  OutputState os;
+// The alignment MLP's first layer computes aIH * [s; h_j], which splits into
+// aIH_state * s + aIH_annotation * h_j. The second term only depends on the
+// source sentence, so it is computed once per sentence and cached here.
+// Annotations are stored as the columns of a matrix so that the alignment MLP
+// can run over every source position at once.
+struct AttentionCache {
+  Expression annotation_matrix; // [h_1 ... h_S]
+  Expression annotation_projection; // aIH_annotation * [h_1 ... h_S]
+  Expression i_state_IH; // aIH_state
+};
+
+// Everything the decoder reads from a source sentence, see AttentionalModel::Encode.
+// Its expressions live in the graph it was encoded in, so it can only be decoded from
+// in that graph, but there as often as needed: one encoder pass can serve any number
+// of beam searches, samples, alignments and scored targets.
+struct EncodedSource {
+  AttentionCache attention; // Annotation matrix and precomputed attention keys
+  Expression zeroth_context;
+  MLP aligner;
+  MLP final;
+};
+
+// One node of a beam search: a hypothesis is its last word plus a back-pointer to the
+// node for the words before it. The nodes of a search live in one arena, so extending a
+// hypothesis copies none of its words, and hypotheses that share a prefix share its nodes.
+struct HypothesisNode {
+  int parent; // Index in the arena, or -1 for the empty hypothesis
+  WordId word; // Unused for the empty hypothesis
+  unsigned length;
+  double score;
+  OutputState os; // Decoder state after reading word. Not computed for finished hypotheses.
+
+  HypothesisNode(int parent, WordId word, unsigned length, double score) : parent(parent), word(word), length(length), score(score) {}
 };
 
 class AttentionalModel {
 public:
-  AttentionalModel(){}
+  AttentionalModel() : softmax_type("full"), negative_samples(0) {}
   void Initialize(Model& model, unsigned src_vocab_size, unsigned tgt_vocab_size);
+  // Like Initialize, but every parameter reads its values in place from blocks, which are in
+  // the order of model.parameters_list() and then lookup_parameters_list() after Initialize.
+  // Nothing of the parameters' size is allocated or randomly initialized, and the parameters
+  // have no gradients, so they can only be used for inference. Returns false if blocks
+  // holds the wrong number of parameters.
+  bool InitializeMapped(Model& model, unsigned src_vocab_size, unsigned tgt_vocab_size, const vector<float*>& blocks);
   void SetParams(boost::program_options::variables_map vm);
+  // Chooses the loss BuildGraph trains with: "full" (the default), "sampled" or "nce".
+  // The sampled objectives score each graph's target words plus negative_samples words drawn
+  // from the distribution proportional to target_counts. Decoding and scoring always use the full softmax.
+  void SetTrainingObjective(const string& type, unsigned negative_samples, const vector<double>& target_counts);
+  // Reseeds the RNG the sampled objectives draw their negatives with. Processes that train
+  // together, and a run resumed from a checkpoint, must each pass different values (e.g.
+  // include a worker index and the position in training), or they draw the same negatives.
+  // The RNG's state is not saved in checkpoints.
+  void SeedNoise(const vector<unsigned>& values);
   vector<Expression> BuildForwardAnnotations(const vector<WordId>& sentence, ComputationGraph& hg);
   vector<Expression> BuildReverseAnnotations(const vector<WordId>& sentence, ComputationGraph& hg);
-  vector<Expression> BuildAnnotationVectors(const vector<Expression>& forward_contexts, const vector<Expression>& reverse_contexts, ComputationGraph& hg);
-  OutputState GetNextOutputState(const Expression& context, const Expression& prev_target_word_embedding, const vector<Expression>& annotations, const MLP& aligner, ComputationGraph& hg, vector<float>* out_alignment = NULL);
+  vector<Expression> BuildForwardAnnotations(const vector<vector<WordId> >& sentences, ComputationGraph& hg);
+  vector<Expression> BuildReverseAnnotations(const vector<vector<WordId> >& sentences, ComputationGraph& hg);
+  vector<Expression> BuildAnnotationVectors(const vector<Expression>& forward_contexts, const vector<Expression>& reverse_contexts);
+  AttentionCache BuildAttentionCache(const vector<Expression>& annotations, const MLP& aligner);
+  OutputState GetNextOutputState(const RNNPointer& prev_state, const Expression& context, const Expression& prev_target_word_embedding, const AttentionCache& attention, const MLP& aligner, ComputationGraph& hg, vector<float>* out_alignment = NULL);
+  OutputState GetNextOutputState(const Expression& context, const Expression& prev_target_word_embedding, const AttentionCache& attention, const MLP& aligner, ComputationGraph& hg, vector<float>* out_alignment = NULL);
   Expression ComputeOutputDistribution(const WordId prev_word, const Expression state, const Expression context, const MLP& final, ComputationGraph& hg);
+  Expression ComputeOutputDistribution(const Expression& prev_target_embedding, const Expression state, const Expression context, const MLP& final);
+  Expression ComputeOutputDistributions(const vector<WordId>& prev_words, const vector<Expression>& states, const vector<Expression>& contexts, const MLP& final, ComputationGraph& hg);
   Expression BuildGraph(const vector<WordId>& source, const vector<WordId>& target, ComputationGraph& hg);
+  Expression BuildGraph(const EncodedSource& encoded, const vector<WordId>& target, ComputationGraph& hg);
+  Expression BuildGraph(const vector<vector<WordId> >& sources, const vector<vector<WordId> >& targets, ComputationGraph& hg);
   void GetParams() const;
 
+  EncodedSource Encode(const vector<WordId>& source, ComputationGraph& hg);
+
+  // Each decoder either takes a source, which it encodes in a graph of its own, or a
+  // source already encoded in hg, which it extends.
   vector<vector<float> > Align(const vector<WordId>& source, const vector<WordId>& target);
+  vector<vector<float> > Align(const EncodedSource& encoded, const vector<WordId>& target, ComputationGraph& hg);
   vector<WordId> SampleTranslation(const vector<WordId>& source, WordId kSOS, WordId kEOS, unsigned max_length);
+  vector<WordId> SampleTranslation(const EncodedSource& encoded, WordId kSOS, WordId kEOS, unsigned max_length, ComputationGraph& hg);
+  // Draws count independent translations of source from the model, advancing them together as a batch.
+  // If log_probs is given, it is set to the log probability of each sample.
+  vector<vector<WordId> > SampleTranslations(const vector<WordId>& source, WordId kSOS, WordId kEOS, unsigned count, unsigned max_length,
+      unsigned max_batch_size = 32, vector<double>* log_probs = NULL);
+  vector<vector<WordId> > SampleTranslations(const EncodedSource& encoded, WordId kSOS, WordId kEOS, unsigned count, unsigned max_length,
+      ComputationGraph& hg, vector<double>* log_probs = NULL);
   vector<WordId> Translate(const vector<WordId>& source, WordId kSOS, WordId kEOS, unsigned beam_size, unsigned max_length);
-  KBestList<vector<WordId> > TranslateKBest(const vector<WordId>& source, WordId kSOS, WordId kEOS, unsigned k, unsigned beam_size, unsigned max_length);
+  vector<WordId> Translate(const EncodedSource& encoded, WordId kSOS, WordId kEOS, unsigned beam_size, unsigned max_length, ComputationGraph& hg);
+  // If shortlist is given, only those target words (sorted ids) are scored, see shortlist.h
+  KBestList<vector<WordId> > TranslateKBest(const vector<WordId>& source, WordId kSOS, WordId kEOS, unsigned k, unsigned beam_size, unsigned max_length,
+      const vector<unsigned>* shortlist = NULL);
+  KBestList<vector<WordId> > TranslateKBest(const EncodedSource& encoded, WordId kSOS, WordId kEOS, unsigned k, unsigned beam_size, unsigned max_length,
+      ComputationGraph& hg, const vector<unsigned>* shortlist = NULL);
+  vector<KBestList<vector<WordId> > > TranslateKBest(const vector<vector<WordId> >& sources, WordId kSOS, WordId kEOS, unsigned k, unsigned beam_size, unsigned max_length,
+      const vector<unsigned>* shortlist = NULL);
+  vector<KBestList<vector<WordId> > > TranslateKBest(const vector<EncodedSource>& encoded, WordId kSOS, WordId kEOS, unsigned k, unsigned beam_size, unsigned max_length,
+      ComputationGraph& hg, const vector<unsigned>* shortlist = NULL);
 
 private:
+  MLP BuildSampledOutputLayer(const vector<vector<WordId> >& targets, const MLP& final, ComputationGraph& hg);
+  Expression ComputeOutputLoss(const Expression& output_distribution, const vector<unsigned>& words, ComputationGraph& hg);
+  void InitializeAlignerColumns();
 
   unsigned lstm_layer_count;
   unsigned embedding_dim; // Dimensionality of both source and target word embeddings. For now these are the same.
@@ -71,6 +154,26 @@ private:
   Parameters* p_fHO; // Same, hidden->output weights
   Parameters* p_fOb; // Same, output bias
 
+  // Columns of aIH that multiply the state and the annotation, see BuildAttentionCache.
+  // select_cols keeps a reference to its indices, so they must outlive every graph.
+  vector<unsigned> aligner_state_cols;
+  vector<unsigned> aligner_annotation_cols;
+
+  vector<vector<float> > target_masks; // Backing storage for the padding masks of a minibatch graph
+
+  // Training objective, see SetTrainingObjective. Not serialized: it does not change the model.
+  string softmax_type;
+  unsigned negative_samples;
+  discrete_distribution<unsigned> noise_distribution;
+  vector<float> noise_log_probs; // log q(w) of each target word
+  mt19937 noise_rng; // See SeedNoise
+  // The words the sampled objectives score in the current graph, and backing storage for their inputs
+  vector<unsigned> candidate_words;
+  vector<int> candidate_positions; // Index of each target word in candidate_words, or -1
+  vector<float> candidate_log_expected_counts; // log(negative_samples * q(w))
+  vector<float> negative_counts; // How often each candidate was drawn as a negative
+
+  friend class InferenceModel;
   friend class boost::serialization::access;
   template<class Archive> void serialize(Archive& ar, const unsigned int) {
     ar & lstm_layer_count;
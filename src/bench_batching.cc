@@ -0,0 +1,100 @@
+#include <iostream>
+#include <chrono>
+#include <cmath>
+
+#include "cnn/cnn.h"
+#include "bitext.h"
+#include "attentional.h"
+#include "model_io.h"
+#include "kbestlist.h"
+#include "utils.h"
+
+using namespace std;
+using namespace cnn;
+
+// Batching should only change how the work is grouped, so every k-best list must match
+// the one decoded for the same sentence on its own: words exactly, scores to within 1e-4
+bool SameKBest(const KBestList<vector<WordId> >& batched, const KBestList<vector<WordId> >& alone) {
+  const vector<pair<double, vector<WordId> > >& batched_hyps = batched.hypothesis_list();
+  const vector<pair<double, vector<WordId> > >& alone_hyps = alone.hypothesis_list();
+  if (batched_hyps.size() != alone_hyps.size()) {
+    return false;
+  }
+  for (unsigned i = 0; i < batched_hyps.size(); ++i) {
+    if (batched_hyps[i].second != alone_hyps[i].second || fabs(batched_hyps[i].first - alone_hyps[i].first) >= 1e-4) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2 || argc > 6) {
+    cerr << "Usage: " << argv[0] << " modelfile [batch_size [beam_size [kbest_size [max_length]]]] < input" << endl;
+    cerr << "Checks that decoding source sentences in batches (as predict --listen does) gives the same k-best lists" << endl;
+    cerr << "as decoding them one at a time, and measures sentences per second both ways." << endl;
+    exit(1);
+  }
+  const string model_filename = argv[1];
+  const unsigned batch_size = (argc > 2) ? atoi(argv[2]) : 16;
+  const unsigned beam_size = (argc > 3) ? atoi(argv[3]) : 10;
+  const unsigned kbest_size = (argc > 4) ? atoi(argv[4]) : 10;
+  const unsigned max_length = (argc > 5) ? atoi(argv[5]) : 20;
+  cnn::Initialize(argc, argv);
+
+  Dict source_vocab;
+  Dict target_vocab;
+  Model model;
+  AttentionalModel attentional_model;
+  if (!LoadModel(model_filename, source_vocab, target_vocab, attentional_model, model)) {
+    cerr << "ERROR: Unable to open " << model_filename << endl;
+    exit(1);
+  }
+  WordId ksSOS = source_vocab.Convert("<s>");
+  WordId ksEOS = source_vocab.Convert("</s>");
+  WordId ktSOS = target_vocab.Convert("<s>");
+  WordId ktEOS = target_vocab.Convert("</s>");
+
+  vector<vector<WordId> > sources;
+  vector<boost::string_ref> parts;
+  vector<boost::string_ref> tokens;
+  for (string line; getline(cin, line);) {
+    split_fields(line, "|||", &parts);
+    split_words(parts[0], &tokens);
+    vector<WordId> source;
+    source.push_back(ksSOS);
+    convert_words(tokens, source_vocab, &source);
+    source.push_back(ksEOS);
+    sources.push_back(source);
+  }
+
+  auto start = chrono::steady_clock::now();
+  vector<KBestList<vector<WordId> > > batched;
+  for (unsigned i = 0; i < sources.size(); i += batch_size) {
+    const vector<vector<WordId> > batch(sources.begin() + i, sources.begin() + min<size_t>(i + batch_size, sources.size()));
+    for (KBestList<vector<WordId> >& kbest : attentional_model.TranslateKBest(batch, ktSOS, ktEOS, kbest_size, beam_size, max_length)) {
+      batched.push_back(kbest);
+    }
+  }
+  const double batched_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  start = chrono::steady_clock::now();
+  vector<KBestList<vector<WordId> > > alone;
+  for (const vector<WordId>& source : sources) {
+    alone.push_back(attentional_model.TranslateKBest(source, ktSOS, ktEOS, kbest_size, beam_size, max_length));
+  }
+  const double alone_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  unsigned differing = 0;
+  for (unsigned i = 0; i < sources.size(); ++i) {
+    if (!SameKBest(batched[i], alone[i])) {
+      cerr << "ERROR: Sentence " << i << " decodes differently in a batch of " << batch_size << " than on its own" << endl;
+      ++differing;
+    }
+  }
+
+  cout << sources.size() << " sentences: batches of " << batch_size << " " << sources.size() / batched_seconds << " sentences/s, "
+       << "one at a time " << sources.size() / alone_seconds << " sentences/s, "
+       << differing << " k-best list(s) differ" << endl;
+  return (differing == 0) ? 0 : 1;
+}
@@ -0,0 +1,104 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <cmath>
+
+#include "cnn/cnn.h"
+#include "cnn/lstm.h"
+#include "cnn/expr.h"
+#include "inference.h"
+
+using namespace std;
+using namespace cnn;
+using namespace cnn::expr;
+
+// Runs an input sequence through an LSTMBuilder, one graph node at a time the way the
+// decoders do, and returns the top layer's h after every step
+vector<vector<float> > RunBuilder(LSTMBuilder& builder, const vector<vector<float> >& inputs, double* seconds) {
+  auto start = chrono::steady_clock::now();
+  ComputationGraph cg;
+  builder.new_graph(cg);
+  builder.start_new_sequence();
+  vector<vector<float> > outputs;
+  for (const vector<float>& x : inputs) {
+    builder.add_input(input(cg, {(long)x.size()}, &x));
+    outputs.push_back(as_vector(cg.incremental_forward()));
+  }
+  *seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  return outputs;
+}
+
+int main(int argc, char** argv) {
+  cnn::Initialize(argc, argv);
+  if (argc > 5) {
+    cerr << "Usage: " << argv[0] << " [input_dim [hidden_dim [steps [columns]]]]" << endl;
+    cerr << "Checks FusedLSTM against LSTMBuilder and measures microseconds per step for 1 to 4 layers." << endl;
+    exit(1);
+  }
+  const unsigned input_dim = (argc > 1) ? atoi(argv[1]) : 512;
+  const unsigned hidden_dim = (argc > 2) ? atoi(argv[2]) : 512;
+  const unsigned steps = (argc > 3) ? atoi(argv[3]) : 100;
+  // As many columns as a beam has hypotheses
+  const unsigned columns = (argc > 4) ? atoi(argv[4]) : 12;
+  const float tolerance = 1e-4;
+
+  mt19937 rng(1);
+  uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+  vector<vector<float> > inputs(steps, vector<float>(input_dim));
+  for (vector<float>& x : inputs) {
+    for (float& v : x) {
+      v = uniform(rng);
+    }
+  }
+
+  bool ok = true;
+  for (unsigned layer_count = 1; layer_count <= 4; ++layer_count) {
+    Model model;
+    LSTMBuilder builder(layer_count, input_dim, hidden_dim, &model);
+    vector<LSTMLayer> layers;
+    for (const vector<Parameters*>& params : builder.params) {
+      layers.push_back(LSTMLayer(params));
+    }
+    FusedLSTM fused(layers);
+
+    double builder_seconds;
+    vector<vector<float> > expected = RunBuilder(builder, inputs, &builder_seconds);
+
+    LSTMState state = fused.InitialState(1);
+    Eigen::MatrixXf x(input_dim, 1);
+    Eigen::MatrixXf outputs(hidden_dim, steps);
+    auto start = chrono::steady_clock::now();
+    for (unsigned t = 0; t < steps; ++t) {
+      x.col(0) = Eigen::Map<const Eigen::VectorXf>(inputs[t].data(), input_dim);
+      fused.Step(x, &state);
+      outputs.col(t) = state.h.back();
+    }
+    double fused_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    float max_difference = 0.0f;
+    for (unsigned t = 0; t < steps; ++t) {
+      for (unsigned i = 0; i < hidden_dim; ++i) {
+        max_difference = max(max_difference, fabs(outputs(i, t) - expected[t][i]));
+      }
+    }
+
+    LSTMState beam_state = fused.InitialState(columns);
+    Eigen::MatrixXf beam_x(input_dim, columns);
+    start = chrono::steady_clock::now();
+    for (unsigned t = 0; t < steps; ++t) {
+      beam_x.colwise() = Eigen::Map<const Eigen::VectorXf>(inputs[t].data(), input_dim);
+      fused.Step(beam_x, &beam_state);
+    }
+    double beam_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << layer_count << " layer(s): LSTMBuilder " << 1e6 * builder_seconds / steps << " us/step, "
+         << "fused " << 1e6 * fused_seconds / steps << " us/step (" << builder_seconds / fused_seconds << "x), "
+         << "fused with " << columns << " columns " << 1e6 * beam_seconds / steps << " us/step, "
+         << "max |h difference| " << max_difference << endl;
+    if (!(max_difference <= tolerance)) {
+      cerr << "ERROR: FusedLSTM differs from LSTMBuilder by more than " << tolerance << " with " << layer_count << " layer(s)" << endl;
+      ok = false;
+    }
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,114 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <random>
+
+#include "utils.h"
+
+using namespace std;
+
+// The per-line parsing the tools used before: copying tokenize, and a trim that
+// erases empty tokens one at a time
+void copying_trim(vector<string>& tokens, bool removeEmpty) {
+  for (unsigned i = 0; i < tokens.size(); ++i) {
+    boost::algorithm::trim(tokens[i]);
+    if (tokens[i].length() == 0 && removeEmpty) {
+      tokens.erase(tokens.begin() + i);
+      --i;
+    }
+  }
+}
+
+unsigned ParseCopying(const string& line) {
+  vector<string> parts = tokenize(line, "|||");
+  copying_trim(parts, false);
+  unsigned word_count = 0;
+  for (const string& part : parts) {
+    vector<string> tokens = tokenize(part, " ");
+    copying_trim(tokens, true);
+    word_count += tokens.size();
+  }
+  return word_count;
+}
+
+unsigned ParseViews(const string& line, vector<boost::string_ref>* parts, vector<boost::string_ref>* tokens) {
+  split_fields(line, "|||", parts);
+  unsigned word_count = 0;
+  for (boost::string_ref part : *parts) {
+    split_words(part, tokens);
+    word_count += tokens->size();
+  }
+  return word_count;
+}
+
+// Synthetic sentence pairs of 5 to 50 words per side, with some doubled spaces
+vector<string> MakeLines(unsigned line_count) {
+  mt19937 rng(1);
+  uniform_int_distribution<unsigned> length(5, 50);
+  uniform_int_distribution<unsigned> word_length(1, 10);
+  uniform_int_distribution<unsigned> letter('a', 'z');
+  uniform_int_distribution<unsigned> extra_space(0, 9);
+  vector<string> lines(line_count);
+  for (string& line : lines) {
+    for (unsigned side = 0; side < 2; ++side) {
+      line += (side == 0) ? "" : " ||| ";
+      for (unsigned i = length(rng); i > 0; --i) {
+        for (unsigned j = word_length(rng); j > 0; --j) {
+          line += (char)letter(rng);
+        }
+        line += (extra_space(rng) == 0) ? "  " : " ";
+      }
+    }
+  }
+  return lines;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 2) {
+    cerr << "Usage: " << argv[0] << " [corpus]" << endl;
+    cerr << "Measures lines per second of the copying and the zero-copy input parsing." << endl;
+    exit(1);
+  }
+
+  vector<string> lines;
+  if (argc == 2) {
+    ifstream f(argv[1]);
+    if (!f.is_open()) {
+      cerr << "ERROR: Unable to open " << argv[1] << endl;
+      exit(1);
+    }
+    for (string line; getline(f, line);) {
+      lines.push_back(line);
+    }
+  }
+  else {
+    lines = MakeLines(200000);
+  }
+
+  const unsigned repetitions = 5;
+  unsigned long copying_words = 0;
+  auto start = chrono::steady_clock::now();
+  for (unsigned r = 0; r < repetitions; ++r) {
+    for (const string& line : lines) {
+      copying_words += ParseCopying(line);
+    }
+  }
+  double copying_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  unsigned long view_words = 0;
+  vector<boost::string_ref> parts;
+  vector<boost::string_ref> tokens;
+  start = chrono::steady_clock::now();
+  for (unsigned r = 0; r < repetitions; ++r) {
+    for (const string& line : lines) {
+      view_words += ParseViews(line, &parts, &tokens);
+    }
+  }
+  double view_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  const double line_count = (double)lines.size() * repetitions;
+  cout << "copying tokenize + trim: " << line_count / copying_seconds << " lines/s (" << copying_words << " words)" << endl;
+  cout << "split_fields + split_words: " << line_count / view_seconds << " lines/s (" << view_words << " words)" << endl;
+  cout << "speedup: " << copying_seconds / view_seconds << "x" << endl;
+  return 0;
+}
@@ -1,41 +1,522 @@
 #include <fstream>
+#include <sstream>
+#include <cstring>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/archive/text_iarchive.hpp>
 #include "bitext.h"
 
 using namespace std;
 
+static const char kCorpusMagic[8] = {'A', 'M', 'B', 'I', 'T', 'X', 'T', '\0'};
+static const uint32_t kCorpusVersion = 1;
+static const uint64_t kCorpusAlignment = 64;
+static const uint64_t kCorpusHeaderSize = sizeof(kCorpusMagic) + 2 * sizeof(uint32_t) + 6 * sizeof(uint64_t);
+
 unsigned Bitext::size() const {
+  if (mapped_words != nullptr) {
+    return mapped_size;
+  }
   assert(source_sentences.size() == target_sentences.size());
   return source_sentences.size();
 }
 
-bool ReadCorpus(string filename, Bitext& bitext, bool add_bos_eos) {
+SentenceView Bitext::source(unsigned i) const {
+  if (mapped_words != nullptr) {
+    return {mapped_words + mapped_offsets[2 * i], (unsigned)(mapped_offsets[2 * i + 1] - mapped_offsets[2 * i])};
+  }
+  return {source_sentences[i].data(), (unsigned)source_sentences[i].size()};
+}
+
+SentenceView Bitext::target(unsigned i) const {
+  if (mapped_words != nullptr) {
+    return {mapped_words + mapped_offsets[2 * i + 1], (unsigned)(mapped_offsets[2 * i + 2] - mapped_offsets[2 * i + 1])};
+  }
+  return {target_sentences[i].data(), (unsigned)target_sentences[i].size()};
+}
+
+// Converts the boundary symbols first, so that they get the same ids in every vocabulary
+static void AddBoundarySymbols(Dict& source_vocab, Dict& target_vocab) {
+  source_vocab.Convert("<s>");
+  source_vocab.Convert("</s>");
+  target_vocab.Convert("<s>");
+  target_vocab.Convert("</s>");
+}
+
+static void ParseSentencePair(const string& line, Dict& source_vocab, Dict& target_vocab, bool add_bos_eos,
+    vector<WordId>* source, vector<WordId>* target) {
+  if (add_bos_eos) {
+    source->push_back(source_vocab.Convert("<s>"));
+    target->push_back(target_vocab.Convert("<s>"));
+  }
+  ReadSentencePair(line, source, &source_vocab, target, &target_vocab);
+  if (add_bos_eos) {
+    source->push_back(source_vocab.Convert("</s>"));
+    target->push_back(target_vocab.Convert("</s>"));
+  }
+}
+
+// Sentences parsed from one byte range of a corpus, with word ids local to that range
+struct CorpusChunk {
+  vector<vector<WordId> > source_sentences;
+  vector<vector<WordId> > target_sentences;
+  Dict source_vocab;
+  Dict target_vocab;
+};
+
+static void ParseChunk(const char* begin, const char* end, bool keep_sentences, CorpusChunk* chunk) {
+  vector<WordId> source;
+  vector<WordId> target;
+  while (begin < end) {
+    const char* newline = (const char*)memchr(begin, '\n', end - begin);
+    const char* line_end = (newline != nullptr) ? newline : end;
+    source.clear();
+    target.clear();
+    ReadSentencePair(string(begin, line_end), &source, &chunk->source_vocab, &target, &chunk->target_vocab);
+    if (keep_sentences) {
+      chunk->source_sentences.push_back(source);
+      chunk->target_sentences.push_back(target);
+    }
+    begin = line_end + 1;
+  }
+}
+
+// Adds the words of a chunk's vocabulary to the global one, in the order the chunk first
+// saw them, and returns the global id of each local id
+static vector<WordId> MergeVocabulary(Dict& chunk_vocab, Dict& vocab) {
+  vector<WordId> global_ids(chunk_vocab.size());
+  for (unsigned i = 0; i < chunk_vocab.size(); ++i) {
+    global_ids[i] = vocab.Convert(chunk_vocab.Convert((int)i));
+  }
+  return global_ids;
+}
+
+// Parses a corpus with thread_count threads. The file is mmapped and split into byte
+// ranges that end on line boundaries. Merging the chunks' vocabularies in chunk order
+// assigns every word the id it would get from reading the file line by line.
+static bool ReadCorpusParallel(const string& filename, Dict& source_vocab, Dict& target_vocab, bool add_bos_eos,
+    unsigned thread_count, Bitext* bitext) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  if (add_bos_eos) {
+    AddBoundarySymbols(source_vocab, target_vocab);
+  }
+  const size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return true;
+  }
+  const char* data = (const char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  // Every chunk boundary must be past the first byte, since it looks at the byte before
+  thread_count = min<size_t>(thread_count, size);
+  vector<size_t> boundaries(thread_count + 1, size);
+  boundaries[0] = 0;
+  for (unsigned i = 1; i < thread_count; ++i) {
+    size_t boundary = max(size / thread_count * i, boundaries[i - 1]);
+    while (boundary < size && data[boundary - 1] != '\n') {
+      boundary++;
+    }
+    boundaries[i] = boundary;
+  }
+
+  const bool keep_sentences = (bitext != nullptr);
+  vector<CorpusChunk> chunks(thread_count);
+  vector<thread> threads;
+  for (unsigned i = 0; i < thread_count; ++i) {
+    threads.push_back(thread(ParseChunk, data + boundaries[i], data + boundaries[i + 1], keep_sentences, &chunks[i]));
+  }
+  for (thread& t : threads) {
+    t.join();
+  }
+  munmap((void*)data, size);
+
+  vector<vector<WordId> > source_ids(thread_count);
+  vector<vector<WordId> > target_ids(thread_count);
+  for (unsigned i = 0; i < thread_count; ++i) {
+    source_ids[i] = MergeVocabulary(chunks[i].source_vocab, source_vocab);
+    target_ids[i] = MergeVocabulary(chunks[i].target_vocab, target_vocab);
+  }
+  if (!keep_sentences) {
+    return true;
+  }
+
+  // Rewrite the sentences with global ids and move them into place, again one thread per chunk
+  vector<unsigned> first_sentence(thread_count + 1, bitext->source_sentences.size());
+  for (unsigned i = 0; i < thread_count; ++i) {
+    first_sentence[i + 1] = first_sentence[i] + chunks[i].source_sentences.size();
+  }
+  bitext->source_sentences.resize(first_sentence[thread_count]);
+  bitext->target_sentences.resize(first_sentence[thread_count]);
+  const WordId sBOS = add_bos_eos ? source_vocab.Convert("<s>") : -1;
+  const WordId sEOS = add_bos_eos ? source_vocab.Convert("</s>") : -1;
+  const WordId tBOS = add_bos_eos ? target_vocab.Convert("<s>") : -1;
+  const WordId tEOS = add_bos_eos ? target_vocab.Convert("</s>") : -1;
+  auto remap = [&](unsigned i) {
+    auto remap_sentence = [&](const vector<WordId>& ids, WordId bos, WordId eos, vector<WordId>* sentence) {
+      vector<WordId> result;
+      result.reserve(sentence->size() + (add_bos_eos ? 2 : 0));
+      if (add_bos_eos) {
+        result.push_back(bos);
+      }
+      for (WordId w : *sentence) {
+        result.push_back(ids[w]);
+      }
+      if (add_bos_eos) {
+        result.push_back(eos);
+      }
+      sentence->swap(result);
+    };
+    for (unsigned j = 0; j < chunks[i].source_sentences.size(); ++j) {
+      remap_sentence(source_ids[i], sBOS, sEOS, &chunks[i].source_sentences[j]);
+      remap_sentence(target_ids[i], tBOS, tEOS, &chunks[i].target_sentences[j]);
+      bitext->source_sentences[first_sentence[i] + j].swap(chunks[i].source_sentences[j]);
+      bitext->target_sentences[first_sentence[i] + j].swap(chunks[i].target_sentences[j]);
+    }
+  };
+  threads.clear();
+  for (unsigned i = 0; i < thread_count; ++i) {
+    threads.push_back(thread(remap, i));
+  }
+  for (thread& t : threads) {
+    t.join();
+  }
+  return true;
+}
+
+bool ReadCorpus(string filename, Bitext& bitext, bool add_bos_eos, unsigned thread_count) {
+  if (thread_count > 1) {
+    return ReadCorpusParallel(filename, bitext.source_vocab, bitext.target_vocab, add_bos_eos, thread_count, &bitext);
+  }
+
   ifstream f(filename);
   if (!f.is_open()) {
     return false;
   }
 
-  WordId sBOS, sEOS, tBOS, tEOS;
   if (add_bos_eos) {
-    sBOS = bitext.source_vocab.Convert("<s>");
-    sEOS = bitext.source_vocab.Convert("</s>");
-    tBOS = bitext.target_vocab.Convert("<s>");
-    tEOS = bitext.target_vocab.Convert("</s>");
+    AddBoundarySymbols(bitext.source_vocab, bitext.target_vocab);
   }
 
   for (string line; getline(f, line);) {
     vector<WordId> source;
     vector<WordId> target;
-    if (add_bos_eos) {
-      source.push_back(sBOS);
-      target.push_back(tBOS);
-    }
-    ReadSentencePair(line, &source, &bitext.source_vocab, &target, &bitext.target_vocab);
-    if (add_bos_eos) {
-      source.push_back(sEOS);
-      target.push_back(tEOS);
-    }
+    ParseSentencePair(line, bitext.source_vocab, bitext.target_vocab, add_bos_eos, &source, &target);
     bitext.source_sentences.push_back(source);
     bitext.target_sentences.push_back(target);
   }
   return true;
 }
+
+bool ReadVocabulary(string filename, Dict& source_vocab, Dict& target_vocab, bool add_bos_eos, unsigned thread_count) {
+  if (thread_count > 1) {
+    return ReadCorpusParallel(filename, source_vocab, target_vocab, add_bos_eos, thread_count, nullptr);
+  }
+
+  ifstream f(filename);
+  if (!f.is_open()) {
+    return false;
+  }
+
+  if (add_bos_eos) {
+    AddBoundarySymbols(source_vocab, target_vocab);
+  }
+
+  vector<WordId> source;
+  vector<WordId> target;
+  for (string line; getline(f, line);) {
+    source.clear();
+    target.clear();
+    ReadSentencePair(line, &source, &source_vocab, &target, &target_vocab);
+  }
+  return true;
+}
+
+StreamingBitext::StreamingBitext(const string& filename, Dict& source_vocab, Dict& target_vocab, bool add_bos_eos, unsigned chunk_size, unsigned prefetch_count) :
+    filename(filename), source_vocab(source_vocab), target_vocab(target_vocab), add_bos_eos(add_bos_eos),
+    chunk_size(max(chunk_size, 1U)), prefetch_count(max(prefetch_count, 1U)), line_count(0), reader_done(true), stopping(false) {
+  source_vocab.Freeze();
+  target_vocab.Freeze();
+
+  // Only the offset of every chunk_size-th line is kept
+  ifstream f(filename);
+  if (!f.is_open()) {
+    return;
+  }
+  streampos offset = f.tellg();
+  for (string line; getline(f, line); offset = f.tellg()) {
+    if (line_count % this->chunk_size == 0) {
+      chunk_offsets.push_back(offset);
+    }
+    line_count++;
+  }
+}
+
+StreamingBitext::~StreamingBitext() {
+  Stop();
+}
+
+bool StreamingBitext::is_open() const {
+  return line_count > 0;
+}
+
+unsigned StreamingBitext::size() const {
+  return line_count;
+}
+
+unsigned StreamingBitext::chunk_count() const {
+  return chunk_offsets.size();
+}
+
+void StreamingBitext::Start(const vector<unsigned>& order) {
+  Stop();
+  stopping = false;
+  reader_done = false;
+  reader = thread(&StreamingBitext::ReadChunks, this, order);
+}
+
+// Abandons the current epoch, if any
+void StreamingBitext::Stop() {
+  {
+    lock_guard<mutex> lock(queue_mutex);
+    stopping = true;
+  }
+  not_full.notify_all();
+  if (reader.joinable()) {
+    reader.join();
+  }
+  for (Bitext* chunk : queue) {
+    delete chunk;
+  }
+  queue.clear();
+}
+
+bool StreamingBitext::NextChunk(Bitext* chunk) {
+  Bitext* next = nullptr;
+  {
+    unique_lock<mutex> lock(queue_mutex);
+    not_empty.wait(lock, [this]() { return !queue.empty() || reader_done; });
+    if (queue.empty()) {
+      return false;
+    }
+    next = queue.front();
+    queue.pop_front();
+  }
+  not_full.notify_one();
+
+  chunk->source_sentences.swap(next->source_sentences);
+  chunk->target_sentences.swap(next->target_sentences);
+  delete next;
+  return true;
+}
+
+// Runs on the reader thread. The vocabularies are frozen, so looking words up
+// here does not race with anything the training thread does.
+void StreamingBitext::ReadChunks(vector<unsigned> order) {
+  ifstream f(filename);
+  string line;
+  for (unsigned c : order) {
+    Bitext* chunk = new Bitext();
+    f.clear();
+    f.seekg(chunk_offsets[c]);
+    for (unsigned i = 0; i < chunk_size && getline(f, line); ++i) {
+      vector<WordId> source;
+      vector<WordId> target;
+      ParseSentencePair(line, source_vocab, target_vocab, add_bos_eos, &source, &target);
+      chunk->source_sentences.push_back(source);
+      chunk->target_sentences.push_back(target);
+    }
+
+    unique_lock<mutex> lock(queue_mutex);
+    not_full.wait(lock, [this]() { return queue.size() < prefetch_count || stopping; });
+    if (stopping) {
+      delete chunk;
+      break;
+    }
+    queue.push_back(chunk);
+    lock.unlock();
+    not_empty.notify_one();
+  }
+
+  {
+    lock_guard<mutex> lock(queue_mutex);
+    reader_done = true;
+  }
+  not_empty.notify_all();
+}
+
+bool IsNumberizedCorpus(const string& filename) {
+  ifstream f(filename, ios::binary);
+  char magic[sizeof(kCorpusMagic)];
+  return f.read(magic, sizeof(magic)) && memcmp(magic, kCorpusMagic, sizeof(kCorpusMagic)) == 0;
+}
+
+static void WritePadding(ofstream& out) {
+  const uint64_t offset = out.tellp();
+  const string padding((kCorpusAlignment - offset % kCorpusAlignment) % kCorpusAlignment, '\0');
+  out.write(padding.data(), padding.size());
+}
+
+bool WriteNumberizedCorpus(const string& input_filename, const string& output_filename,
+    Dict& source_vocab, Dict& target_vocab, bool add_bos_eos) {
+  ifstream in(input_filename);
+  if (!in.is_open()) {
+    return false;
+  }
+  ofstream out(output_filename, ios::binary);
+  if (!out.is_open()) {
+    return false;
+  }
+  source_vocab.Freeze();
+  target_vocab.Freeze();
+
+  ostringstream metadata_stream;
+  {
+    boost::archive::text_oarchive oa(metadata_stream);
+    oa & source_vocab;
+    oa & target_vocab;
+  }
+  const string metadata = metadata_stream.str();
+
+  // The header is rewritten once the counts are known
+  const string header_placeholder(kCorpusHeaderSize, '\0');
+  out.write(header_placeholder.data(), header_placeholder.size());
+  const uint64_t metadata_offset = out.tellp();
+  const uint64_t metadata_size = metadata.size();
+  out.write(metadata.data(), metadata.size());
+  WritePadding(out);
+
+  const uint64_t words_offset = out.tellp();
+  vector<uint64_t> offsets(1, 0);
+  vector<WordId> source;
+  vector<WordId> target;
+  for (string line; getline(in, line);) {
+    source.clear();
+    target.clear();
+    ParseSentencePair(line, source_vocab, target_vocab, add_bos_eos, &source, &target);
+    out.write((const char*)source.data(), source.size() * sizeof(WordId));
+    out.write((const char*)target.data(), target.size() * sizeof(WordId));
+    offsets.push_back(offsets.back() + source.size());
+    offsets.push_back(offsets.back() + target.size());
+  }
+  const uint64_t pair_count = (offsets.size() - 1) / 2;
+  const uint64_t word_count = offsets.back();
+  WritePadding(out);
+
+  const uint64_t offsets_offset = out.tellp();
+  out.write((const char*)offsets.data(), offsets.size() * sizeof(uint64_t));
+
+  const uint32_t flags = add_bos_eos ? 1 : 0;
+  out.seekp(0);
+  out.write(kCorpusMagic, sizeof(kCorpusMagic));
+  out.write((const char*)&kCorpusVersion, sizeof(kCorpusVersion));
+  out.write((const char*)&flags, sizeof(flags));
+  out.write((const char*)&metadata_offset, sizeof(metadata_offset));
+  out.write((const char*)&metadata_size, sizeof(metadata_size));
+  out.write((const char*)&pair_count, sizeof(pair_count));
+  out.write((const char*)&words_offset, sizeof(words_offset));
+  out.write((const char*)&word_count, sizeof(word_count));
+  out.write((const char*)&offsets_offset, sizeof(offsets_offset));
+  out.flush();
+  return (bool)out;
+}
+
+bool MapCorpus(const string& filename, Bitext& bitext) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < kCorpusHeaderSize) {
+    close(fd);
+    return false;
+  }
+  const uint64_t file_size = st.st_size;
+  // Shared, read-only mapping: the pages come straight from the page cache. It is never unmapped.
+  const char* data = (const char*)mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  if (memcmp(data, kCorpusMagic, sizeof(kCorpusMagic)) != 0) {
+    cerr << "ERROR: " << filename << " is not a numberized corpus" << endl;
+    exit(1);
+  }
+
+  const char* p = data + sizeof(kCorpusMagic);
+  uint32_t version, flags;
+  memcpy(&version, p, sizeof(version)); p += sizeof(uint32_t);
+  memcpy(&flags, p, sizeof(flags)); p += sizeof(uint32_t);
+  if (version != kCorpusVersion) {
+    cerr << "ERROR: " << filename << " has unsupported corpus format version " << version << endl;
+    exit(1);
+  }
+  // Training reads sentences that start with <s> and end with </s>
+  if ((flags & 1) == 0) {
+    cerr << "ERROR: " << filename << " was numberized without <s> and </s>" << endl;
+    exit(1);
+  }
+  uint64_t metadata_offset, metadata_size, pair_count, words_offset, word_count, offsets_offset;
+  memcpy(&metadata_offset, p, sizeof(uint64_t)); p += sizeof(uint64_t);
+  memcpy(&metadata_size, p, sizeof(uint64_t)); p += sizeof(uint64_t);
+  memcpy(&pair_count, p, sizeof(uint64_t)); p += sizeof(uint64_t);
+  memcpy(&words_offset, p, sizeof(uint64_t)); p += sizeof(uint64_t);
+  memcpy(&word_count, p, sizeof(uint64_t)); p += sizeof(uint64_t);
+  memcpy(&offsets_offset, p, sizeof(uint64_t)); p += sizeof(uint64_t);
+  // Every check is written so that it cannot overflow, whatever the header says.
+  // The offsets table has 2 * pair_count + 1 entries.
+  if (metadata_offset > file_size || metadata_size > file_size - metadata_offset
+      || words_offset > file_size || word_count > (file_size - words_offset) / sizeof(WordId)
+      || offsets_offset > file_size || (file_size - offsets_offset) / sizeof(uint64_t) == 0
+      || pair_count > ((file_size - offsets_offset) / sizeof(uint64_t) - 1) / 2) {
+    cerr << "ERROR: " << filename << " is truncated" << endl;
+    exit(1);
+  }
+  if (words_offset % kCorpusAlignment != 0 || offsets_offset % kCorpusAlignment != 0) {
+    cerr << "ERROR: " << filename << " has a misaligned section" << endl;
+    exit(1);
+  }
+  if (pair_count > UINT_MAX) {
+    cerr << "ERROR: " << filename << " has more than " << UINT_MAX << " sentence pairs" << endl;
+    exit(1);
+  }
+  // Bitext::source and Bitext::target index the words with these, so they must stay inside the words
+  const uint64_t* offsets = (const uint64_t*)(data + offsets_offset);
+  for (uint64_t i = 0; i <= 2 * pair_count; ++i) {
+    if (offsets[i] > word_count || (i > 0 && offsets[i] < offsets[i - 1])) {
+      cerr << "ERROR: " << filename << " has corrupt sentence offsets" << endl;
+      exit(1);
+    }
+  }
+  if (offsets[2 * pair_count] != word_count) {
+    cerr << "ERROR: " << filename << " has corrupt sentence offsets" << endl;
+    exit(1);
+  }
+
+  istringstream metadata(string(data + metadata_offset, metadata_size));
+  boost::archive::text_iarchive ia(metadata);
+  ia & bitext.source_vocab;
+  ia & bitext.target_vocab;
+  bitext.source_vocab.Freeze();
+  bitext.target_vocab.Freeze();
+
+  bitext.mapped_words = (const WordId*)(data + words_offset);
+  bitext.mapped_offsets = offsets;
+  bitext.mapped_size = pair_count;
+  return true;
+}
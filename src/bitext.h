@@ -1,5 +1,13 @@
 #pragma once
 #include <vector>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <fstream>
+#include <cstdint>
 #include "cnn/dict.h"
 
 using namespace std;
@@ -7,13 +15,115 @@ using namespace cnn;
 
 typedef int WordId;
 
+// A read-only view of one sentence, which may live in a vector or in a mapped corpus
+struct SentenceView {
+  const WordId* first;
+  unsigned length;
+
+  unsigned size() const { return length; }
+  const WordId* begin() const { return first; }
+  const WordId* end() const { return first + length; }
+  WordId operator[](unsigned i) const { return first[i]; }
+};
+
+// The sentences are either held in source_sentences and target_sentences, or, for a
+// corpus opened with MapCorpus, in a read-only mapping of the numberized file. Use
+// source() and target() to read them either way.
 struct Bitext {
   vector<vector<WordId> > source_sentences;
   vector<vector<WordId> > target_sentences;
   Dict source_vocab;
   Dict target_vocab;
 
+  // Set by MapCorpus: every sentence's words back to back, and for pair i the offsets
+  // of its source words (2i), its target words (2i + 1) and the next pair (2i + 2)
+  const WordId* mapped_words = nullptr;
+  const uint64_t* mapped_offsets = nullptr;
+  unsigned mapped_size = 0;
+
   unsigned size() const;
+  SentenceView source(unsigned i) const;
+  SentenceView target(unsigned i) const;
 };
 
-bool ReadCorpus(string filename, Bitext& bitext, bool add_bos_eos);
+// Reads a ||| separated text corpus, adding its words to the vocabularies. With more
+// than one thread, each thread parses a disjoint byte range of the file into its own
+// vocabularies, which are then merged in file order, so word ids are exactly those
+// the single-threaded reader would assign.
+bool ReadCorpus(string filename, Bitext& bitext, bool add_bos_eos, unsigned thread_count = 1);
+
+// Numberized corpus format (version 1), written by bin/numberize. Integers are uint64
+// in native byte order unless noted.
+//   magic "AMBITXT\0" (8 bytes), version (uint32), flags (uint32, bit 0: <s> and </s> added)
+//   metadata offset, metadata size: a Boost text archive of the source and target vocabularies
+//   sentence pair count, offset of the words, word count, offset of the sentence offsets
+//   the words: WordIds (int32), starting on a 64-byte boundary
+//   the sentence offsets: 2 * pair count + 1 word indices, starting on a 64-byte boundary
+bool IsNumberizedCorpus(const string& filename);
+
+// Converts a text corpus into the numberized format, using vocabularies that already
+// contain all of its words (see ReadVocabulary). Reads the corpus one line at a time.
+bool WriteNumberizedCorpus(const string& input_filename, const string& output_filename,
+    Dict& source_vocab, Dict& target_vocab, bool add_bos_eos);
+
+// Opens a numberized corpus. The file is mmapped and the sentences are read straight
+// from the mapping, so concurrent processes share its pages. Opening it only reads the
+// header, the vocabularies and the sentence offsets, which are checked to lie inside the
+// words. The vocabularies are frozen. Returns false if the file cannot be opened.
+bool MapCorpus(const string& filename, Bitext& bitext);
+
+// Builds the vocabularies of a corpus without keeping any of its sentences.
+// Word ids are assigned in the same order as ReadCorpus would assign them.
+bool ReadVocabulary(string filename, Dict& source_vocab, Dict& target_vocab, bool add_bos_eos, unsigned thread_count = 1);
+
+// Reads a corpus that is too large to keep in memory. The vocabularies must already
+// contain every word of the corpus and are frozen. The corpus is split into chunks of
+// chunk_size lines. Each epoch visits the chunks in a random order, and a background
+// thread reads at most prefetch_count chunks ahead of the caller, so memory use does
+// not depend on the size of the corpus.
+class StreamingBitext {
+public:
+  StreamingBitext(const string& filename, Dict& source_vocab, Dict& target_vocab, bool add_bos_eos, unsigned chunk_size, unsigned prefetch_count);
+  ~StreamingBitext();
+
+  bool is_open() const;
+  unsigned size() const;
+  unsigned chunk_count() const;
+
+  // Shuffles the order of the chunks and starts reading them
+  template <class RNG>
+  void StartEpoch(RNG& g) {
+    vector<unsigned> order(chunk_offsets.size());
+    for (unsigned i = 0; i < order.size(); ++i) {
+      order[i] = i;
+    }
+    shuffle(order.begin(), order.end(), g);
+    Start(order);
+  }
+
+  // Replaces the sentences of *chunk with those of the next chunk of the epoch.
+  // Returns false once every chunk of the epoch has been returned.
+  bool NextChunk(Bitext* chunk);
+
+private:
+  void Start(const vector<unsigned>& order);
+  void Stop();
+  void ReadChunks(vector<unsigned> order);
+
+  string filename;
+  Dict& source_vocab;
+  Dict& target_vocab;
+  bool add_bos_eos;
+  unsigned chunk_size;
+  unsigned prefetch_count;
+  unsigned line_count;
+  vector<streampos> chunk_offsets;
+
+  thread reader;
+  mutex queue_mutex;
+  condition_variable not_empty;
+  condition_variable not_full;
+  deque<Bitext*> queue;
+  bool reader_done;
+  bool stopping;
+};
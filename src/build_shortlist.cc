@@ -0,0 +1,126 @@
+#include "cnn/cnn.h"
+
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+#include <csignal>
+
+#include "bitext.h"
+#include "attentional.h"
+#include "model_io.h"
+#include "utils.h"
+
+using namespace cnn;
+using namespace std;
+
+bool ctrlc_pressed = false;
+void ctrlc_handler(int signal) {
+  if (ctrlc_pressed) {
+    exit(1);
+  }
+  else {
+    ctrlc_pressed = true;
+  }
+}
+
+// Learns the tables used by predict's --shortlist_frequent and --shortlist_lexicon.
+// Target word counts come straight from the corpus. The lexicon scores p(target | source)
+// from the model's attention: every target word adds its alignment weight over the
+// source positions to the (source word, target word) pairs.
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    cerr << "Usage: cat bitext.txt | " << argv[0] << " model output_prefix [candidates_per_word]" << endl;
+    cerr << "Writes output_prefix.frequent and output_prefix.lexicon for predict's shortlist." << endl;
+    exit(1);
+  }
+  signal (SIGINT, ctrlc_handler);
+
+  const string model_filename = argv[1];
+  const string output_prefix = argv[2];
+  const unsigned candidate_count = (argc > 3) ? stoul(argv[3]) : 50;
+  cnn::Initialize(argc, argv);
+  Dict source_vocab;
+  Dict target_vocab;
+  Model model;
+  AttentionalModel attentional_model;
+  if (!LoadModel(model_filename, source_vocab, target_vocab, attentional_model, model)) {
+    cerr << "ERROR: Unable to open " << model_filename << endl;
+    exit(1);
+  }
+
+  WordId ksBOS = source_vocab.Convert("<s>");
+  WordId ksEOS = source_vocab.Convert("</s>");
+  WordId ktBOS = target_vocab.Convert("<s>");
+  WordId ktEOS = target_vocab.Convert("</s>");
+
+  vector<double> target_counts(target_vocab.size(), 0.0);
+  vector<unordered_map<WordId, double> > cooccurrences(source_vocab.size()); // Indexed by source word
+  string line;
+  vector<boost::string_ref> parts;
+  vector<boost::string_ref> tokens;
+  vector<WordId> source;
+  vector<WordId> target;
+  unsigned line_count = 0;
+  for (; getline(cin, line) && !ctrlc_pressed;) {
+    split_fields(line, "|||", &parts);
+    if (parts.size() < 2) {
+      cerr << "ERROR: Expected a source and a target sentence separated by |||: " << line << endl;
+      exit(1);
+    }
+    split_words(parts[0], &tokens);
+    source.clear();
+    source.push_back(ksBOS);
+    convert_words(tokens, source_vocab, &source);
+    source.push_back(ksEOS);
+    split_words(parts[1], &tokens);
+    target.clear();
+    target.push_back(ktBOS);
+    convert_words(tokens, target_vocab, &target);
+    target.push_back(ktEOS);
+
+    // Row j of the alignment is the attention used to predict target[j + 1]
+    vector<vector<float> > alignment = attentional_model.Align(source, target);
+    for (unsigned j = 0; j + 2 < target.size(); ++j) {
+      WordId t = target[j + 1];
+      target_counts[t] += 1.0;
+      for (unsigned i = 1; i + 1 < source.size(); ++i) {
+        cooccurrences[source[i]][t] += alignment[j][i];
+      }
+    }
+    if (++line_count % 1000 == 0) {
+      cerr << "Aligned " << line_count << " lines" << endl;
+    }
+  }
+
+  const string frequent_filename = output_prefix + ".frequent";
+  ofstream frequent_file(frequent_filename);
+  if (!frequent_file.is_open()) {
+    cerr << "ERROR: Unable to write " << frequent_filename << endl;
+    exit(1);
+  }
+  for (unsigned t = 0; t < target_counts.size(); ++t) {
+    if (target_counts[t] > 0.0) {
+      frequent_file << target_vocab.Convert(t) << " " << target_counts[t] << endl;
+    }
+  }
+
+  const string lexicon_filename = output_prefix + ".lexicon";
+  ofstream lexicon_file(lexicon_filename);
+  if (!lexicon_file.is_open()) {
+    cerr << "ERROR: Unable to write " << lexicon_filename << endl;
+    exit(1);
+  }
+  for (unsigned s = 0; s < cooccurrences.size(); ++s) {
+    double total = 0.0;
+    KBestList<WordId> best(candidate_count);
+    for (const pair<const WordId, double>& entry : cooccurrences[s]) {
+      total += entry.second;
+      best.add(entry.second, entry.first);
+    }
+    for (const pair<double, WordId>& p : best.hypothesis_list()) {
+      lexicon_file << source_vocab.Convert(s) << " " << target_vocab.Convert(p.second) << " " << p.first / total << endl;
+    }
+  }
+  cerr << "Wrote " << frequent_filename << " and " << lexicon_filename << " from " << line_count << " lines" << endl;
+  return 0;
+}
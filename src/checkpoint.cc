@@ -0,0 +1,158 @@
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cassert>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+
+using namespace std;
+
+Checkpointer::Checkpointer(const string& prefix, unsigned keep, unsigned every_sentences, unsigned every_seconds)
+    : prefix(prefix), keep(keep), every_sentences(every_sentences), every_seconds(every_seconds), sentences_since_save(0),
+      last_save(chrono::steady_clock::now()) {
+  // keep == 0 would delete each checkpoint right after writing it
+  assert (keep > 0);
+}
+
+// Flushes a file, or a directory's entries, to disk. rename() alone only orders the
+// names: after a crash the new name could point to a file whose data never made it.
+static bool Sync(const string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+static string DirectoryOf(const string& filename) {
+  size_t slash = filename.rfind('/');
+  if (slash == string::npos) {
+    return ".";
+  }
+  return (slash == 0) ? "/" : filename.substr(0, slash);
+}
+
+Checkpointer::~Checkpointer() {
+  Wait();
+}
+
+bool Checkpointer::Tick(unsigned sentence_count) {
+  sentences_since_save += sentence_count;
+  if (every_sentences > 0 && sentences_since_save >= every_sentences) {
+    return true;
+  }
+  if (every_seconds > 0 && chrono::steady_clock::now() - last_save >= chrono::seconds(every_seconds)) {
+    return true;
+  }
+  return false;
+}
+
+void Checkpointer::Save(Dict& source_vocab, Dict& target_vocab, AttentionalModel& attentional_model, Model& model, const TrainingState& state) {
+  // Only one checkpoint is written at a time
+  Wait();
+  sentences_since_save = 0;
+  last_save = chrono::steady_clock::now();
+
+  ostringstream filename;
+  filename << prefix << ".iter" << state.iteration << ".mb" << state.next_minibatch << ".model";
+  ModelSnapshot snapshot = SnapshotModel(source_vocab, target_vocab, attentional_model, model);
+  writer = thread(&Checkpointer::Write, this, move(snapshot), state, filename.str());
+}
+
+void Checkpointer::Wait() {
+  if (writer.joinable()) {
+    writer.join();
+  }
+}
+
+void Checkpointer::Write(const ModelSnapshot& snapshot, const TrainingState& state, const string& filename) {
+  const string state_filename = filename + ".state";
+  const string temp_filename = filename + ".tmp";
+  const string temp_state_filename = state_filename + ".tmp";
+
+  const string directory = DirectoryOf(filename);
+
+  if (!WriteBinaryModel(temp_filename, snapshot) || !Sync(temp_filename) || rename(temp_filename.c_str(), filename.c_str()) != 0 || !Sync(directory)) {
+    cerr << "WARNING: Unable to write checkpoint " << filename << endl;
+    remove(temp_filename.c_str());
+    return;
+  }
+
+  // The state file goes last: its presence marks the checkpoint as complete
+  {
+    ofstream out(temp_state_filename);
+    out << "iteration " << state.iteration << endl;
+    out << "next_minibatch " << state.next_minibatch << endl;
+    out << "eta " << state.eta << endl;
+    out << "epoch " << state.epoch << endl;
+    out << "updates " << state.updates << endl;
+    out << "rng " << state.rng_state << endl;
+    out.flush();
+    if (!out) {
+      cerr << "WARNING: Unable to write checkpoint " << state_filename << endl;
+      remove(temp_state_filename.c_str());
+      return;
+    }
+  }
+  if (!Sync(temp_state_filename) || rename(temp_state_filename.c_str(), state_filename.c_str()) != 0 || !Sync(directory)) {
+    cerr << "WARNING: Unable to write checkpoint " << state_filename << endl;
+    return;
+  }
+  cerr << "Wrote checkpoint " << filename << endl;
+
+  saved.push_back(filename);
+  while (saved.size() > keep) {
+    remove((saved.front() + ".state").c_str());
+    remove(saved.front().c_str());
+    saved.pop_front();
+  }
+}
+
+void SaveTrainerState(const Trainer& trainer, TrainingState* state) {
+  state->eta = trainer.eta;
+  state->epoch = trainer.epoch;
+  state->updates = trainer.updates;
+}
+
+void RestoreTrainerState(const TrainingState& state, Trainer* trainer) {
+  trainer->eta = state.eta;
+  trainer->epoch = state.epoch;
+  trainer->updates = state.updates;
+}
+
+bool LoadTrainingState(const string& model_filename, TrainingState* state) {
+  ifstream in(model_filename + ".state");
+  if (!in.is_open()) {
+    return false;
+  }
+  string key;
+  while (in >> key) {
+    if (key == "iteration") {
+      in >> state->iteration;
+    }
+    else if (key == "next_minibatch") {
+      in >> state->next_minibatch;
+    }
+    else if (key == "eta") {
+      in >> state->eta;
+    }
+    else if (key == "epoch") {
+      in >> state->epoch;
+    }
+    else if (key == "updates") {
+      in >> state->updates;
+    }
+    else if (key == "rng") {
+      getline(in, state->rng_state);
+    }
+    else {
+      cerr << "ERROR: Unknown key " << key << " in " << model_filename << ".state" << endl;
+      exit(1);
+    }
+  }
+  return true;
+}
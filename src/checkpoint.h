@@ -0,0 +1,68 @@
+#pragma once
+#include <string>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include "cnn/cnn.h"
+#include "cnn/dict.h"
+#include "cnn/training.h"
+#include "model_io.h"
+
+using namespace std;
+using namespace cnn;
+
+// Where training is, so that a run can be resumed from a checkpoint
+struct TrainingState {
+  unsigned iteration = 0; // The epoch in progress
+  unsigned next_minibatch = 0; // The first minibatch of that epoch not trained on yet
+  string rng_state; // The state of the shuffling RNG at the start of the epoch
+  // The negative sampling RNG is not saved. A resumed run reseeds it from the position
+  // above, see AttentionalModel::SeedNoise.
+  // Trainer schedule. The per-parameter state of adaptive trainers (e.g. Adagrad's
+  // accumulated squared gradients) is not exposed by cnn, and starts over on resume.
+  float eta = 0.0;
+  float epoch = 0.0;
+  float updates = 0.0;
+};
+
+// Writes checkpoints as <prefix>.iter<I>.mb<M>.model, in the binary model format, so
+// a checkpoint can be used by predict directly, next to a small <...>.model.state
+// text file with the TrainingState. A checkpoint is complete once its state file exists.
+// Files are written to a temporary name, synced to disk and renamed, and the directory
+// is synced after each rename, so a crash never leaves a truncated checkpoint behind.
+// Writing happens on a background thread from a copy of the parameters, so training
+// only pauses for the copy.
+class Checkpointer {
+public:
+  Checkpointer(const string& prefix, unsigned keep, unsigned every_sentences, unsigned every_seconds);
+  ~Checkpointer();
+
+  // Records that sentence_count more sentences were trained on.
+  // Returns true if a checkpoint is due according to the sentence or time interval.
+  bool Tick(unsigned sentence_count);
+
+  void Save(Dict& source_vocab, Dict& target_vocab, AttentionalModel& attentional_model, Model& model, const TrainingState& state);
+
+  // Blocks until the checkpoint being written, if any, is finished
+  void Wait();
+
+private:
+  void Write(const ModelSnapshot& snapshot, const TrainingState& state, const string& filename);
+
+  string prefix;
+  unsigned keep; // Number of checkpoints to keep on disk, at least 1
+  unsigned every_sentences; // 0 means no sentence interval
+  unsigned every_seconds; // 0 means no time interval
+  unsigned sentences_since_save;
+  chrono::steady_clock::time_point last_save;
+  thread writer;
+  deque<string> saved; // Complete checkpoints written by this run, oldest first
+};
+
+// Copies the trainer's schedule into state, and back
+void SaveTrainerState(const Trainer& trainer, TrainingState* state);
+void RestoreTrainerState(const TrainingState& state, Trainer* trainer);
+
+// Reads the state file of the checkpoint model_filename. Returns false if it is missing,
+// which means that the checkpoint was never completed.
+bool LoadTrainingState(const string& model_filename, TrainingState* state);
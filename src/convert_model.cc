@@ -0,0 +1,33 @@
+#include "cnn/cnn.h"
+
+#include <iostream>
+
+#include "bitext.h"
+#include "attentional.h"
+#include "model_io.h"
+
+using namespace cnn;
+using namespace std;
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    cerr << "Usage: " << argv[0] << " input_model output_model" << endl;
+    cerr << "Converts a model written by train into the binary model format." << endl;
+    exit(1);
+  }
+
+  const string input_filename = argv[1];
+  const string output_filename = argv[2];
+  cnn::Initialize(argc, argv);
+  Dict source_vocab;
+  Dict target_vocab;
+  Model model;
+  AttentionalModel attentional_model;
+  if (!LoadModel(input_filename, source_vocab, target_vocab, attentional_model, model)) {
+    cerr << "ERROR: Unable to open " << input_filename << endl;
+    exit(1);
+  }
+  SaveBinaryModel(output_filename, source_vocab, target_vocab, attentional_model, model);
+  cerr << "Wrote " << output_filename << endl;
+  return 0;
+}
@@ -0,0 +1,341 @@
+#include <cmath>
+#include "inference.h"
+#include "partial_softmax.h"
+
+using namespace std;
+using namespace cnn;
+
+typedef Eigen::MatrixXf Matrix;
+typedef Eigen::VectorXf Vector;
+
+// Eigen evaluates float tanh with a vectorized rational approximation, accurate to a
+// few ulp. The logistic function is written in terms of it, which costs less than the
+// exp and division of 1 / (1 + exp(-x)).
+static void SigmoidInPlace(Eigen::Ref<Matrix> x) {
+  x.array() = 0.5f * (0.5f * x.array()).tanh() + 0.5f;
+}
+
+LSTMLayer::LSTMLayer(const vector<Parameters*>& params) {
+  assert (params.size() == 11);
+  x2i = BoundMatrix(params[0]);
+  h2i = BoundMatrix(params[1]);
+  c2i = BoundMatrix(params[2]);
+  bi = BoundMatrix(params[3]);
+  x2o = BoundMatrix(params[4]);
+  h2o = BoundMatrix(params[5]);
+  c2o = BoundMatrix(params[6]);
+  bo = BoundMatrix(params[7]);
+  x2c = BoundMatrix(params[8]);
+  h2c = BoundMatrix(params[9]);
+  bc = BoundMatrix(params[10]);
+}
+
+InferenceModel::InferenceModel(const AttentionalModel& model) {
+  output_state_dim = model.output_state_dim;
+  half_annotation_dim = model.half_annotation_dim;
+  p_Es = model.p_Es;
+  p_Et = model.p_Et;
+  vector<LSTMLayer> forward_layers, reverse_layers, output_layers;
+  for (const vector<Parameters*>& params : model.forward_builder.params) {
+    forward_layers.push_back(LSTMLayer(params));
+  }
+  for (const vector<Parameters*>& params : model.reverse_builder.params) {
+    reverse_layers.push_back(LSTMLayer(params));
+  }
+  for (const vector<Parameters*>& params : model.output_builder.params) {
+    output_layers.push_back(LSTMLayer(params));
+  }
+  forward_lstm = FusedLSTM(forward_layers);
+  reverse_lstm = FusedLSTM(reverse_layers);
+  output_lstm = FusedLSTM(output_layers);
+  aIH = BoundMatrix(model.p_aIH);
+  aHb = BoundMatrix(model.p_aHb);
+  aHO = BoundMatrix(model.p_aHO);
+  aOb = BoundMatrix(model.p_aOb);
+  Ws = BoundMatrix(model.p_Ws);
+  bs = BoundMatrix(model.p_bs);
+  fIH = BoundMatrix(model.p_fIH);
+  fHb = BoundMatrix(model.p_fHb);
+  fHO = BoundMatrix(model.p_fHO);
+  fOb = BoundMatrix(model.p_fOb);
+}
+
+FusedLSTM::FusedLSTM(const vector<LSTMLayer>& bound_layers) {
+  for (const LSTMLayer& bound : bound_layers) {
+    StackedLayer layer;
+    layer.input_dim = bound.x2i.cols;
+    layer.hidden_dim = bound.h2i.cols;
+    const unsigned I = layer.input_dim;
+    const unsigned H = layer.hidden_dim;
+    // Stacking over x and h as well, into one [x; h] product, is slower with more than
+    // one column: Eigen's blocking suits two products of half the depth better
+    layer.input_weights.resize(3 * H, I);
+    layer.input_weights << bound.x2i.matrix(), bound.x2c.matrix(), bound.x2o.matrix();
+    layer.hidden_weights.resize(3 * H, H);
+    layer.hidden_weights << bound.h2i.matrix(), bound.h2c.matrix(), bound.h2o.matrix();
+    layer.bias.resize(3 * H);
+    layer.bias << bound.bi.column(), bound.bc.column(), bound.bo.column();
+    layer.c2i = bound.c2i;
+    layer.c2o = bound.c2o;
+    layers.push_back(layer);
+  }
+}
+
+LSTMState FusedLSTM::InitialState(unsigned columns) const {
+  // h and c start at zero, so the first step's input gate and candidate get nothing
+  // from them; only its output gate needs has_prev_state, see Step
+  LSTMState state;
+  state.has_prev_state = false;
+  for (const StackedLayer& layer : layers) {
+    state.h.push_back(Matrix::Zero(layer.hidden_dim, columns));
+    state.c.push_back(Matrix::Zero(layer.hidden_dim, columns));
+  }
+  return state;
+}
+
+// The same computation as LSTMBuilder::add_input: the forget gate is 1 - the input gate,
+// the input gate peeks at the old c and the output gate at the new one. On the first
+// step of a sequence LSTMBuilder leaves the output gate's peephole out, although the
+// new c is not zero.
+void FusedLSTM::Step(const Matrix& x, LSTMState* state) const {
+  const unsigned columns = x.cols();
+  const Matrix* input = &x;
+  for (unsigned l = 0; l < layers.size(); ++l) {
+    const StackedLayer& layer = layers[l];
+    const unsigned H = layer.hidden_dim;
+    Matrix& h = state->h[l];
+    Matrix& c = state->c[l];
+    Matrix& gates = layer.gates;
+    gates.resize(3 * H, columns);
+    gates.noalias() = layer.input_weights * *input;
+    gates.colwise() += layer.bias;
+
+    auto input_gate = gates.topRows(H);
+    auto candidate = gates.middleRows(H, H);
+    auto output_gate = gates.bottomRows(H);
+    if (state->has_prev_state) {
+      gates.noalias() += layer.hidden_weights * h;
+      input_gate.noalias() += layer.c2i.matrix() * c;
+    }
+    SigmoidInPlace(input_gate);
+    candidate.array() = candidate.array().tanh();
+    // c = (1 - i) * c + i * candidate
+    c.array() += input_gate.array() * (candidate.array() - c.array());
+    if (state->has_prev_state) {
+      output_gate.noalias() += layer.c2o.matrix() * c;
+    }
+    SigmoidInPlace(output_gate);
+    // The candidate rows are free again, so they take tanh(c)
+    candidate.array() = c.array().tanh();
+    h.array() = output_gate.array() * candidate.array();
+    input = &h;
+  }
+  state->has_prev_state = true;
+}
+
+InferenceSource InferenceModel::Encode(const vector<WordId>& source) const {
+  const unsigned length = source.size();
+  const unsigned embedding_dim = p_Es->dim.size();
+  InferenceSource encoded;
+  encoded.annotations.resize(2 * half_annotation_dim, length);
+
+  Matrix x(embedding_dim, 1);
+  LSTMState forward_state = forward_lstm.InitialState(1);
+  for (unsigned t = 0; t < length; ++t) {
+    x.col(0) = Eigen::Map<const Vector>(p_Es->values[source[t]].v, embedding_dim);
+    forward_lstm.Step(x, &forward_state);
+    encoded.annotations.block(0, t, half_annotation_dim, 1) = forward_state.h.back();
+  }
+  LSTMState reverse_state = reverse_lstm.InitialState(1);
+  for (unsigned t = length; t > 0; ) {
+    t--;
+    x.col(0) = Eigen::Map<const Vector>(p_Es->values[source[t]].v, embedding_dim);
+    reverse_lstm.Step(x, &reverse_state);
+    encoded.annotations.block(half_annotation_dim, t, half_annotation_dim, 1) = reverse_state.h.back();
+  }
+
+  // aIH's columns are laid out as [state; annotation], see BuildAttentionCache
+  encoded.annotation_projection = aIH.matrix().rightCols(2 * half_annotation_dim) * encoded.annotations;
+  // The reverse LSTM's output at position 0 is its state after reading the whole sentence
+  encoded.zeroth_context = (Ws.matrix() * reverse_state.h.back().col(0) + bs.column()).array().tanh().matrix();
+  return encoded;
+}
+
+void InferenceModel::LookupTargetEmbeddings(const vector<WordId>& words, Matrix* embeddings) const {
+  const unsigned embedding_dim = p_Et->dim.size();
+  embeddings->resize(embedding_dim, words.size());
+  for (unsigned i = 0; i < words.size(); ++i) {
+    embeddings->col(i) = Eigen::Map<const Vector>(p_Et->values[words[i]].v, embedding_dim);
+  }
+}
+
+// See AttentionalModel::GetNextOutputState
+void InferenceModel::DecoderStep(const InferenceSource& encoded, const Matrix& prev_embeddings, LSTMState* state, Matrix* contexts,
+    vector<float>* out_alignment) const {
+  const unsigned columns = prev_embeddings.cols();
+  Matrix rnn_input(contexts->rows() + prev_embeddings.rows(), columns);
+  rnn_input << *contexts, prev_embeddings;
+  output_lstm.Step(rnn_input, state);
+  const Matrix& new_states = state->h.back();
+
+  Matrix state_projections = (aIH.matrix().leftCols(output_state_dim) * new_states).colwise() + aHb.column();
+  const float output_bias = aOb.values[0];
+  for (unsigned i = 0; i < columns; ++i) {
+    Matrix hidden = (encoded.annotation_projection.colwise() + state_projections.col(i)).array().tanh().matrix();
+    Eigen::RowVectorXf scores = aHO.matrix() * hidden;
+    scores.array() += output_bias - scores.maxCoeff();
+    Eigen::RowVectorXf alignment = scores.array().exp().matrix();
+    alignment /= alignment.sum();
+    contexts->col(i) = encoded.annotations * alignment.transpose();
+    if (i == 0 && out_alignment != NULL) {
+      out_alignment->assign(alignment.data(), alignment.data() + alignment.size());
+    }
+  }
+}
+
+// See AttentionalModel::ComputeOutputDistributions
+void InferenceModel::ComputeLogits(const Matrix& prev_embeddings, const LSTMState& state, const Matrix& contexts,
+    const Matrix* output_weights, const Vector* output_bias, Matrix* logits) const {
+  const unsigned columns = prev_embeddings.cols();
+  Matrix final_input(prev_embeddings.rows() + state.h.back().rows() + contexts.rows(), columns);
+  final_input << prev_embeddings, state.h.back(), contexts;
+  Matrix hidden = ((fIH.matrix() * final_input).colwise() + fHb.column()).array().tanh().matrix();
+  if (output_weights != NULL) {
+    logits->noalias() = *output_weights * hidden;
+    logits->colwise() += *output_bias;
+  }
+  else {
+    logits->noalias() = fHO.matrix() * hidden;
+    logits->colwise() += fOb.column();
+  }
+}
+
+KBestList<vector<WordId> > InferenceModel::TranslateKBest(const vector<WordId>& source, WordId kSOS, WordId kEOS, unsigned k, unsigned beam_size, unsigned max_length,
+    const vector<unsigned>* shortlist) const {
+  assert(k <= beam_size);
+  InferenceSource encoded = Encode(source);
+
+  // Gather the shortlisted rows of the output layer once per sentence, see TranslateKBest
+  Matrix shortlist_weights;
+  Vector shortlist_bias;
+  if (shortlist != NULL) {
+    shortlist_weights.resize(shortlist->size(), fHO.cols);
+    shortlist_bias.resize(shortlist->size());
+    for (unsigned r = 0; r < shortlist->size(); ++r) {
+      shortlist_weights.row(r) = fHO.matrix().row((*shortlist)[r]);
+      shortlist_bias(r) = fOb.values[(*shortlist)[r]];
+    }
+  }
+
+  // The arena only holds words and back-pointers. Decoder states exist for the live
+  // hypotheses only: column c of state and contexts belongs to live[c].
+  vector<HypothesisNode> arena;
+  KBestList<unsigned> completed_hyps(k);
+  vector<unsigned> live;
+  vector<WordId> last_words;
+
+  HypothesisNode initial_hyp(-1, kSOS, 0, 0.0);
+  arena.push_back(initial_hyp);
+  live.push_back(0);
+  last_words.push_back(kSOS);
+  LSTMState state = output_lstm.InitialState(1);
+  Matrix contexts = encoded.zeroth_context;
+  Matrix embeddings;
+  LookupTargetEmbeddings(last_words, &embeddings);
+  DecoderStep(encoded, embeddings, &state, &contexts);
+
+  Matrix logits;
+  for (unsigned length = 0; length < max_length && live.size() > 0; ++length) {
+    ComputeLogits(embeddings, state, contexts, (shortlist != NULL) ? &shortlist_weights : NULL, &shortlist_bias, &logits);
+    const unsigned vocab_size = logits.rows();
+
+    // Extensions are (column of the parent, new word) pairs
+    KBestList<pair<unsigned, WordId> > extensions(beam_size);
+    for (unsigned c = 0; c < live.size(); ++c) {
+      const unsigned h = live[c];
+      KBestList<WordId> best_words(beam_size);
+      float log_z = LogSumExpTopK(logits.data() + c * vocab_size, vocab_size, &best_words);
+      for (pair<double, WordId> p : best_words.hypothesis_list()) {
+        double new_score = arena[h].score + p.first - log_z;
+        WordId word = (shortlist != NULL) ? (*shortlist)[p.second] : p.second;
+        if (length + 1 == max_length || word == kEOS) {
+          if (completed_hyps.accepts(new_score)) {
+            HypothesisNode new_hyp((int)h, word, length + 1, new_score);
+            completed_hyps.add(new_score, arena.size());
+            arena.push_back(new_hyp);
+          }
+        }
+        else {
+          extensions.emplace(new_score, c, word);
+        }
+      }
+    }
+
+    // Gather the states of the parents of the survivors, then advance them all at once
+    const vector<pair<double, pair<unsigned, WordId> > >& survivors = extensions.hypothesis_list();
+    vector<unsigned> new_live(survivors.size());
+    LSTMState new_state = output_lstm.InitialState(survivors.size());
+    new_state.has_prev_state = state.has_prev_state;
+    Matrix new_contexts(contexts.rows(), survivors.size());
+    last_words.resize(survivors.size());
+    for (unsigned i = 0; i < survivors.size(); ++i) {
+      const unsigned parent_column = survivors[i].second.first;
+      HypothesisNode new_hyp((int)live[parent_column], survivors[i].second.second, length + 1, survivors[i].first);
+      new_live[i] = arena.size();
+      arena.push_back(new_hyp);
+      last_words[i] = new_hyp.word;
+      for (unsigned l = 0; l < output_lstm.layer_count(); ++l) {
+        new_state.h[l].col(i) = state.h[l].col(parent_column);
+        new_state.c[l].col(i) = state.c[l].col(parent_column);
+      }
+      new_contexts.col(i) = contexts.col(parent_column);
+    }
+    live = move(new_live);
+    state = move(new_state);
+    contexts = move(new_contexts);
+    if (live.size() > 0) {
+      LookupTargetEmbeddings(last_words, &embeddings);
+      DecoderStep(encoded, embeddings, &state, &contexts);
+    }
+  }
+
+  KBestList<vector<WordId> > kbest(k);
+  for (const pair<double, unsigned>& scored_hyp : completed_hyps.hypothesis_list()) {
+    vector<WordId> words(arena[scored_hyp.second].length);
+    for (int i = scored_hyp.second; arena[i].parent >= 0; i = arena[i].parent) {
+      words[arena[i].length - 1] = arena[i].word;
+    }
+    kbest.add(scored_hyp.first, move(words));
+  }
+  return kbest;
+}
+
+double InferenceModel::Loss(const vector<WordId>& source, const vector<WordId>& target) const {
+  assert (target.size() > 2);
+  InferenceSource encoded = Encode(source);
+  LSTMState state = output_lstm.InitialState(1);
+  Matrix contexts = encoded.zeroth_context;
+  Matrix embeddings;
+  Matrix logits;
+  double loss = 0.0;
+  for (unsigned t = 1; t < target.size(); ++t) {
+    LookupTargetEmbeddings(vector<WordId>(1, target[t - 1]), &embeddings);
+    DecoderStep(encoded, embeddings, &state, &contexts);
+    ComputeLogits(embeddings, state, contexts, NULL, NULL, &logits);
+    loss += LogSumExp(logits.data(), logits.rows()) - logits(target[t], 0);
+  }
+  return loss;
+}
+
+vector<vector<float> > InferenceModel::Align(const vector<WordId>& source, const vector<WordId>& target) const {
+  InferenceSource encoded = Encode(source);
+  LSTMState state = output_lstm.InitialState(1);
+  Matrix contexts = encoded.zeroth_context;
+  Matrix embeddings;
+  vector<vector<float> > alignment(target.size());
+  for (unsigned t = 1; t < target.size() + 1; ++t) {
+    LookupTargetEmbeddings(vector<WordId>(1, target[t - 1]), &embeddings);
+    DecoderStep(encoded, embeddings, &state, &contexts, &alignment[t - 1]);
+  }
+  return alignment;
+}
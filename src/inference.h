@@ -0,0 +1,125 @@
+#pragma once
+#include <vector>
+#include <Eigen/Core>
+#include "cnn/cnn.h"
+#include "bitext.h"
+#include "attentional.h"
+#include "kbestlist.h"
+
+using namespace std;
+using namespace cnn;
+
+// A parameter of the trained model, read in place: no copy is made and nothing is
+// ever added to a ComputationGraph.
+struct BoundMatrix {
+  const float* values;
+  unsigned rows;
+  unsigned cols;
+
+  BoundMatrix() : values(NULL), rows(0), cols(0) {}
+  explicit BoundMatrix(const Parameters* p) : values(p->values.v), rows(p->dim.rows()), cols(p->dim.size() / p->dim.rows()) {}
+  Eigen::Map<const Eigen::MatrixXf> matrix() const { return Eigen::Map<const Eigen::MatrixXf>(values, rows, cols); }
+  Eigen::Map<const Eigen::VectorXf> column() const { return Eigen::Map<const Eigen::VectorXf>(values, rows * cols); }
+};
+
+// The weights of one layer of an LSTMBuilder. c2i and c2o are the peephole connections;
+// the forget gate is 1 - the input gate.
+struct LSTMLayer {
+  BoundMatrix x2i, h2i, c2i, bi;
+  BoundMatrix x2o, h2o, c2o, bo;
+  BoundMatrix x2c, h2c, bc;
+
+  LSTMLayer() {}
+  // params are the layer's parameters in the order LSTMBuilder adds them
+  explicit LSTMLayer(const vector<Parameters*>& params);
+};
+
+// The state of a multi-layer LSTM for a set of hypotheses, one column per hypothesis
+struct LSTMState {
+  vector<Eigen::MatrixXf> h; // One matrix per layer
+  vector<Eigen::MatrixXf> c;
+  // False before the first step, which LSTMBuilder computes without the recurrent and
+  // peephole terms
+  bool has_prev_state;
+};
+
+// An inference-only LSTM cell with the weights of an LSTMBuilder, stepping any number of
+// columns at once. The input gate, candidate and output gate weights are stacked, so
+// one matrix product over x and one over h compute all three; only the peephole terms
+// need products of their own. Sigmoid and tanh are vectorized approximations,
+// and h and c are updated in place, with a scratch buffer that is only
+// reallocated when the number of columns changes.
+class FusedLSTM {
+public:
+  FusedLSTM() {}
+  explicit FusedLSTM(const vector<LSTMLayer>& layers);
+
+  unsigned layer_count() const { return layers.size(); }
+  LSTMState InitialState(unsigned columns) const;
+  // Reads column i of x into the LSTM of column i of state
+  void Step(const Eigen::MatrixXf& x, LSTMState* state) const;
+
+private:
+  struct StackedLayer {
+    unsigned input_dim;
+    unsigned hidden_dim;
+    Eigen::MatrixXf input_weights; // [x2i; x2c; x2o]
+    Eigen::MatrixXf hidden_weights; // [h2i; h2c; h2o]
+    Eigen::VectorXf bias; // [bi; bc; bo]
+    BoundMatrix c2i, c2o;
+    mutable Eigen::MatrixXf gates;
+  };
+  vector<StackedLayer> layers;
+};
+
+// What the decoder reads from a source sentence, the counterpart of EncodedSource
+struct InferenceSource {
+  Eigen::MatrixXf annotations; // [h_1 ... h_S]
+  Eigen::MatrixXf annotation_projection; // aIH_annotation * [h_1 ... h_S]
+  Eigen::VectorXf zeroth_context;
+};
+
+// Forward-only decoding for an AttentionalModel, without the ComputationGraph machinery.
+// The model's parameters are bound once, when this is constructed, and read in place.
+// Each step overwrites the buffers of the step before, and only the live hypotheses
+// carry a decoder state, so memory per decode is bounded by the beam size times the
+// state and vocabulary sizes rather than growing with the length of the output.
+// The results match those of AttentionalModel's decoders up to rounding.
+class InferenceModel {
+public:
+  // model must stay loaded for as long as this is used
+  explicit InferenceModel(const AttentionalModel& model);
+
+  InferenceSource Encode(const vector<WordId>& source) const;
+
+  // See AttentionalModel::TranslateKBest
+  KBestList<vector<WordId> > TranslateKBest(const vector<WordId>& source, WordId kSOS, WordId kEOS, unsigned k, unsigned beam_size, unsigned max_length,
+      const vector<unsigned>* shortlist = NULL) const;
+
+  // Returns -log p(target | source), the loss AttentionalModel::BuildGraph computes
+  double Loss(const vector<WordId>& source, const vector<WordId>& target) const;
+
+  // See AttentionalModel::Align
+  vector<vector<float> > Align(const vector<WordId>& source, const vector<WordId>& target) const;
+
+private:
+  // Reads the embeddings of words into the columns of *embeddings
+  void LookupTargetEmbeddings(const vector<WordId>& words, Eigen::MatrixXf* embeddings) const;
+  // Advances the decoder of every hypothesis by reading its last word, whose embedding is
+  // a column of prev_embeddings, and updates the attention contexts in place. If out_alignment
+  // is given, it is set to the attention weights of the first hypothesis.
+  void DecoderStep(const InferenceSource& encoded, const Eigen::MatrixXf& prev_embeddings, LSTMState* state, Eigen::MatrixXf* contexts,
+      vector<float>* out_alignment = NULL) const;
+  // Computes the logits of the next word of every hypothesis, one column each
+  void ComputeLogits(const Eigen::MatrixXf& prev_embeddings, const LSTMState& state, const Eigen::MatrixXf& contexts,
+      const Eigen::MatrixXf* output_weights, const Eigen::VectorXf* output_bias, Eigen::MatrixXf* logits) const;
+
+  unsigned output_state_dim;
+  unsigned half_annotation_dim;
+  const LookupParameters* p_Es;
+  const LookupParameters* p_Et;
+  FusedLSTM forward_lstm, reverse_lstm, output_lstm;
+  BoundMatrix aIH, aHb, aHO, aOb;
+  BoundMatrix Ws, bs;
+  BoundMatrix fIH, fHb, fHO, fOb;
+};
@@ -1,52 +1,114 @@
 #pragma once
-#include <deque>
+#include <vector>
 #include <utility>
+#include <algorithm>
+#include <limits>
+#include <tuple>
 
 using namespace std;
 
+// Keeps the max_size highest scoring hypotheses seen so far. Internally a bounded
+// min-heap, so the worst kept hypothesis is always at hand: adding costs O(log k),
+// and anything scoring at or below the threshold once the list is full is rejected
+// with a single comparison, before any copy is made.
 template <typename T>
 class KBestList {
 public:
   unsigned max_size;
 
-  explicit KBestList(unsigned max_size) : max_size(max_size) {}
+  explicit KBestList(unsigned max_size) : max_size(max_size), sorted(true) {}
 
-  bool add(double score, T hyp) {
-    if (size() == 0) {
-      hypotheses.push_back(make_pair(score, hyp));
-      return true;
+  // The score a new hypothesis must beat to get in
+  double threshold() const {
+    if (size() < max_size) {
+      return -numeric_limits<double>::infinity();
     }
-
-    // Check if this item is worse than EVERYTHING currently in the k-best list
-    if (score < hypotheses.back().first) {
-      if (size() == max_size) {
-        return false;
-      }
-      else {
-        hypotheses.push_back(make_pair(score, hyp));
-        return true;
-      }
+    if (max_size == 0) {
+      return numeric_limits<double>::infinity();
     }
+    return sorted ? hypotheses.back().first : hypotheses.front().first;
+  }
+
+  bool accepts(double score) const {
+    return size() < max_size || score > threshold();
+  }
 
-    // Now we know that there exists atleast one item in the list worse than the new item
-    // So we traverse the list from the end, and find the correct position to insert the
-    // new item into.
-    auto it = hypotheses.begin();
-    for (; it != hypotheses.end() && it->first > score; ++it) {}
-    hypotheses.insert(it, make_pair(score, hyp));
-    if (size() > max_size) {
+  bool add(double score, const T& hyp) {
+    return emplace(score, hyp);
+  }
+
+  bool add(double score, T&& hyp) {
+    return emplace(score, move(hyp));
+  }
+
+  // Constructs the hypothesis in place, and only if it makes it into the list
+  template <typename... Args>
+  bool emplace(double score, Args&&... args) {
+    if (!accepts(score)) {
+      return false;
+    }
+    if (sorted) {
+      make_heap(hypotheses.begin(), hypotheses.end(), WorseFirst);
+      sorted = false;
+    }
+    if (size() == max_size) {
+      pop_heap(hypotheses.begin(), hypotheses.end(), WorseFirst);
       hypotheses.pop_back();
     }
+    hypotheses.emplace_back(piecewise_construct, forward_as_tuple(score), forward_as_tuple(forward<Args>(args)...));
+    push_heap(hypotheses.begin(), hypotheses.end(), WorseFirst);
     return true;
   }
 
-  unsigned size() const { 
+  unsigned size() const {
     return hypotheses.size();
   }
 
-  const deque<pair<double, T> >& hypothesis_list() const {
+  // The hypotheses, best first
+  const vector<pair<double, T> >& hypothesis_list() const {
+    if (!sorted) {
+      sort_heap(hypotheses.begin(), hypotheses.end(), WorseFirst);
+      sorted = true;
+    }
     return hypotheses;
   }
+
 private:
-  deque<pair<double, T>> hypotheses;
+  // Heap order with the lowest score on top. Sorting with it puts the best first.
+  static bool WorseFirst(const pair<double, T>& a, const pair<double, T>& b) {
+    return a.first > b.first;
+  }
+
+  mutable vector<pair<double, T> > hypotheses;
+  mutable bool sorted;
 };
+
+// Adds the indices of the highest of scores[0], ..., scores[count - 1] to *kbest.
+// Once the list is full, scores are scanned in blocks: the maximum of a block is a
+// loop the compiler vectorizes, and only blocks that beat the threshold are looked
+// at one score at a time. For k much smaller than count almost every block is skipped.
+template <typename Index>
+void AddTopK(const float* scores, unsigned count, KBestList<Index>* kbest) {
+  const unsigned kBlockSize = 16;
+  unsigned i = 0;
+  for (; i < count && kbest->size() < kbest->max_size; ++i) {
+    kbest->add(scores[i], (Index)i);
+  }
+  float threshold = kbest->threshold();
+  for (; i < count; i += kBlockSize) {
+    const unsigned end = min(i + kBlockSize, count);
+    float block_max = scores[i];
+    for (unsigned j = i + 1; j < end; ++j) {
+      block_max = max(block_max, scores[j]);
+    }
+    if (block_max <= threshold) {
+      continue;
+    }
+    for (unsigned j = i; j < end; ++j) {
+      if (scores[j] > threshold) {
+        kbest->add(scores[j], (Index)j);
+        threshold = kbest->threshold();
+      }
+    }
+  }
+}
@@ -0,0 +1,238 @@
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/archive/text_oarchive.hpp>
+#include <boost/archive/text_iarchive.hpp>
+
+#include "model_io.h"
+
+using namespace std;
+
+static const char kMagic[8] = {'A', 'M', 'M', 'O', 'D', 'E', 'L', '\0'};
+static const uint32_t kVersion = 1;
+static const uint64_t kAlignment = 64;
+
+static uint64_t Align(uint64_t offset) {
+  return (offset + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+// The number of floats in each parameter block, in file order
+static vector<uint64_t> BlockSizes(Model& model) {
+  vector<uint64_t> sizes;
+  for (Parameters* p : model.parameters_list()) {
+    sizes.push_back(p->values.d.size());
+  }
+  for (LookupParameters* p : model.lookup_parameters_list()) {
+    uint64_t size = 0;
+    for (const Tensor& t : p->values) {
+      size += t.d.size();
+    }
+    sizes.push_back(size);
+  }
+  return sizes;
+}
+
+ModelSnapshot SnapshotModel(Dict& source_vocab, Dict& target_vocab, AttentionalModel& attentional_model, Model& model) {
+  ModelSnapshot snapshot;
+  ostringstream metadata_stream;
+  {
+    boost::archive::text_oarchive oa(metadata_stream);
+    oa & source_vocab;
+    oa & target_vocab;
+    oa << attentional_model;
+  }
+  snapshot.metadata = metadata_stream.str();
+
+  for (Parameters* p : model.parameters_list()) {
+    snapshot.blocks.push_back(vector<float>(p->values.v, p->values.v + p->values.d.size()));
+  }
+  for (LookupParameters* p : model.lookup_parameters_list()) {
+    vector<float> block;
+    for (const Tensor& t : p->values) {
+      block.insert(block.end(), t.v, t.v + t.d.size());
+    }
+    snapshot.blocks.push_back(block);
+  }
+  return snapshot;
+}
+
+bool WriteBinaryModel(const string& filename, const ModelSnapshot& snapshot) {
+  const string& metadata = snapshot.metadata;
+
+  // Lay out the file: header, block table, metadata, then the aligned blocks
+  const uint64_t header_size = sizeof(kMagic) + 2 * sizeof(uint32_t) + 3 * sizeof(uint64_t);
+  const uint64_t metadata_offset = header_size + 2 * sizeof(uint64_t) * snapshot.blocks.size();
+  vector<uint64_t> block_offsets(snapshot.blocks.size());
+  vector<uint64_t> block_sizes(snapshot.blocks.size());
+  uint64_t offset = metadata_offset + metadata.size();
+  for (unsigned i = 0; i < snapshot.blocks.size(); ++i) {
+    block_sizes[i] = snapshot.blocks[i].size();
+    block_offsets[i] = Align(offset);
+    offset = block_offsets[i] + block_sizes[i] * sizeof(float);
+  }
+
+  ofstream out(filename, ios::binary);
+  if (!out.is_open()) {
+    return false;
+  }
+  const uint32_t reserved = 0;
+  const uint64_t metadata_size = metadata.size();
+  const uint64_t block_count = snapshot.blocks.size();
+  out.write(kMagic, sizeof(kMagic));
+  out.write((const char*)&kVersion, sizeof(kVersion));
+  out.write((const char*)&reserved, sizeof(reserved));
+  out.write((const char*)&metadata_offset, sizeof(metadata_offset));
+  out.write((const char*)&metadata_size, sizeof(metadata_size));
+  out.write((const char*)&block_count, sizeof(block_count));
+  for (unsigned i = 0; i < snapshot.blocks.size(); ++i) {
+    out.write((const char*)&block_offsets[i], sizeof(uint64_t));
+    out.write((const char*)&block_sizes[i], sizeof(uint64_t));
+  }
+  out.write(metadata.data(), metadata.size());
+
+  for (unsigned i = 0; i < snapshot.blocks.size(); ++i) {
+    const string padding(block_offsets[i] - out.tellp(), '\0');
+    out.write(padding.data(), padding.size());
+    out.write((const char*)snapshot.blocks[i].data(), snapshot.blocks[i].size() * sizeof(float));
+  }
+  out.flush();
+  return (bool)out;
+}
+
+void SaveBinaryModel(const string& filename, Dict& source_vocab, Dict& target_vocab, AttentionalModel& attentional_model, Model& model) {
+  if (!WriteBinaryModel(filename, SnapshotModel(source_vocab, target_vocab, attentional_model, model))) {
+    cerr << "ERROR: Unable to write " << filename << endl;
+    exit(1);
+  }
+}
+
+// Reads the vocabularies and the hyperparameters, but creates no parameters
+static void ReadMetadata(istream& in, Dict& source_vocab, Dict& target_vocab, AttentionalModel& attentional_model) {
+  boost::archive::text_iarchive ia(in);
+  ia & source_vocab;
+  ia & target_vocab;
+  source_vocab.Freeze();
+  target_vocab.Freeze();
+  ia & attentional_model;
+}
+
+static bool LoadBinaryModel(const string& filename, int fd, Dict& source_vocab, Dict& target_vocab, AttentionalModel& attentional_model, Model& model, bool map_parameters) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return false;
+  }
+  const uint64_t file_size = st.st_size;
+  const uint64_t header_size = sizeof(kMagic) + 2 * sizeof(uint32_t) + 3 * sizeof(uint64_t);
+  if (file_size < header_size) {
+    cerr << "ERROR: " << filename << " is truncated" << endl;
+    exit(1);
+  }
+  // Private, writable mapping: pages stay shared with other processes unless written to
+  char* data = (char*)mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+
+  const char* p = data + sizeof(kMagic);
+  uint32_t version;
+  memcpy(&version, p, sizeof(version));
+  p += 2 * sizeof(uint32_t);
+  if (version != kVersion) {
+    cerr << "ERROR: " << filename << " has unsupported model format version " << version << endl;
+    exit(1);
+  }
+  uint64_t metadata_offset, metadata_size, block_count;
+  memcpy(&metadata_offset, p, sizeof(uint64_t)); p += sizeof(uint64_t);
+  memcpy(&metadata_size, p, sizeof(uint64_t)); p += sizeof(uint64_t);
+  memcpy(&block_count, p, sizeof(uint64_t)); p += sizeof(uint64_t);
+  // Every check is written so that it cannot overflow, whatever the header says
+  if (block_count > (file_size - header_size) / (2 * sizeof(uint64_t)) ||
+      metadata_offset > file_size || metadata_size > file_size - metadata_offset) {
+    cerr << "ERROR: " << filename << " is truncated" << endl;
+    exit(1);
+  }
+  vector<uint64_t> block_offsets(block_count);
+  vector<uint64_t> block_sizes(block_count);
+  for (unsigned i = 0; i < block_count; ++i) {
+    memcpy(&block_offsets[i], p, sizeof(uint64_t)); p += sizeof(uint64_t);
+    memcpy(&block_sizes[i], p, sizeof(uint64_t)); p += sizeof(uint64_t);
+    if (block_offsets[i] > file_size || block_sizes[i] > (file_size - block_offsets[i]) / sizeof(float)) {
+      cerr << "ERROR: " << filename << " is truncated" << endl;
+      exit(1);
+    }
+    if (block_offsets[i] % kAlignment != 0) {
+      cerr << "ERROR: " << filename << " has a misaligned parameter block" << endl;
+      exit(1);
+    }
+  }
+
+  istringstream metadata(string(data + metadata_offset, metadata_size));
+  ReadMetadata(metadata, source_vocab, target_vocab, attentional_model);
+
+  if (!map_parameters) {
+    attentional_model.Initialize(model, source_vocab.size(), target_vocab.size());
+    if (BlockSizes(model) != block_sizes) {
+      cerr << "ERROR: The parameters in " << filename << " do not match the model's dimensions" << endl;
+      exit(1);
+    }
+    unsigned block = 0;
+    for (Parameters* param : model.parameters_list()) {
+      memcpy(param->values.v, data + block_offsets[block++], param->values.d.size() * sizeof(float));
+    }
+    for (LookupParameters* param : model.lookup_parameters_list()) {
+      const float* row = (const float*)(data + block_offsets[block++]);
+      for (Tensor& t : param->values) {
+        memcpy(t.v, row, t.d.size() * sizeof(float));
+        row += t.d.size();
+      }
+    }
+    munmap(data, file_size);
+    return true;
+  }
+
+  // Build the parameters straight onto the mapping, which is never unmapped. Nothing is
+  // read from a block before its size has been checked against the model's dimensions.
+  vector<float*> blocks(block_count);
+  for (unsigned i = 0; i < block_count; ++i) {
+    blocks[i] = (float*)(data + block_offsets[i]);
+  }
+  if (!attentional_model.InitializeMapped(model, source_vocab.size(), target_vocab.size(), blocks) || BlockSizes(model) != block_sizes) {
+    cerr << "ERROR: The parameters in " << filename << " do not match the model's dimensions" << endl;
+    exit(1);
+  }
+  return true;
+}
+
+bool LoadModel(const string& filename, Dict& source_vocab, Dict& target_vocab, AttentionalModel& attentional_model, Model& model, bool map_parameters) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  char magic[sizeof(kMagic)];
+  bool is_binary = read(fd, magic, sizeof(magic)) == sizeof(magic) && memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+  if (is_binary) {
+    bool ok = LoadBinaryModel(filename, fd, source_vocab, target_vocab, attentional_model, model, map_parameters);
+    close(fd);
+    return ok;
+  }
+  close(fd);
+
+  ifstream model_file(filename);
+  if (!model_file.is_open()) {
+    return false;
+  }
+  boost::archive::text_iarchive ia(model_file);
+  ia & source_vocab;
+  ia & target_vocab;
+  source_vocab.Freeze();
+  target_vocab.Freeze();
+  ia & attentional_model;
+  attentional_model.Initialize(model, source_vocab.size(), target_vocab.size());
+  ia & model;
+  return true;
+}
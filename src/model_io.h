@@ -0,0 +1,43 @@
+#pragma once
+#include <string>
+#include "cnn/cnn.h"
+#include "cnn/dict.h"
+#include "bitext.h"
+#include "attentional.h"
+
+using namespace std;
+using namespace cnn;
+
+// Binary model format (version 1). Integers are uint64 in native byte order unless noted.
+//   magic "AMMODEL\0" (8 bytes), version (uint32), reserved (uint32)
+//   metadata offset, metadata size: a Boost text archive of the source vocabulary,
+//     the target vocabulary and the AttentionalModel hyperparameters
+//   block count, followed by (offset, float count) for each parameter block
+//   the blocks themselves: raw floats, each block starting on a 64-byte boundary
+// Blocks follow the order of Model::parameters_list() and then lookup_parameters_list(),
+// with all the rows of a LookupParameters stored back to back in one block.
+
+// A copy of everything the binary format stores, which can be written out later
+// (e.g. from another thread) while training keeps changing the parameters.
+struct ModelSnapshot {
+  string metadata;
+  vector<vector<float> > blocks;
+};
+
+ModelSnapshot SnapshotModel(Dict& source_vocab, Dict& target_vocab, AttentionalModel& attentional_model, Model& model);
+
+// Writes a snapshot in the binary format above. Returns false if the file could not be written.
+bool WriteBinaryModel(const string& filename, const ModelSnapshot& snapshot);
+
+// Writes the model in the binary format above.
+void SaveBinaryModel(const string& filename, Dict& source_vocab, Dict& target_vocab, AttentionalModel& attentional_model, Model& model);
+
+// Loads a model in either the binary format or the Boost text archive written by
+// bin/train, initializing attentional_model and model, and freezing the vocabularies.
+// Binary models are mmapped, and the parameters are built straight onto the mapping
+// (see AttentionalModel::InitializeMapped), so loading neither allocates nor copies the
+// parameters and concurrent processes share their pages. A truncated or inconsistent
+// file is reported as an error.
+// If map_parameters is false, the parameters are copied into the model's own storage
+// instead, which is what training needs. Returns false if the file cannot be opened.
+bool LoadModel(const string& filename, Dict& source_vocab, Dict& target_vocab, AttentionalModel& attentional_model, Model& model, bool map_parameters = true);
@@ -0,0 +1,30 @@
+#include <iostream>
+#include <thread>
+
+#include "bitext.h"
+
+using namespace std;
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    cerr << "Usage: " << argv[0] << " input_corpus output_corpus" << endl;
+    cerr << "Converts a ||| separated text corpus into the numberized format that train mmaps." << endl;
+    exit(1);
+  }
+
+  const string input_filename = argv[1];
+  const string output_filename = argv[2];
+  Dict source_vocab;
+  Dict target_vocab;
+  if (!ReadVocabulary(input_filename, source_vocab, target_vocab, true, max(thread::hardware_concurrency(), 1U))) {
+    cerr << "ERROR: Unable to open " << input_filename << endl;
+    exit(1);
+  }
+  cerr << "Vocab size: " << source_vocab.size() << "/" << target_vocab.size() << endl;
+  if (!WriteNumberizedCorpus(input_filename, output_filename, source_vocab, target_vocab, true)) {
+    cerr << "ERROR: Unable to write " << output_filename << endl;
+    exit(1);
+  }
+  cerr << "Wrote " << output_filename << endl;
+  return 0;
+}
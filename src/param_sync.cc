@@ -0,0 +1,206 @@
+#include <iostream>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "param_sync.h"
+
+using namespace std;
+
+static void WriteAll(int fd, const void* data, size_t size) {
+  const char* p = (const char*)data;
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n <= 0) {
+      cerr << "ERROR: Lost connection to another training process" << endl;
+      exit(1);
+    }
+    p += n;
+    size -= n;
+  }
+}
+
+static void ReadAll(int fd, void* data, size_t size) {
+  char* p = (char*)data;
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n <= 0) {
+      cerr << "ERROR: Lost connection to another training process" << endl;
+      exit(1);
+    }
+    p += n;
+    size -= n;
+  }
+}
+
+static sockaddr_un MakeAddress(const string& socket_path) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    cerr << "ERROR: Socket path " << socket_path << " is too long" << endl;
+    exit(1);
+  }
+  strcpy(address.sun_path, socket_path.c_str());
+  return address;
+}
+
+ParameterAverager::ParameterAverager(const string& socket_path, unsigned rank, unsigned world_size)
+    : rank(rank), world_size(world_size), socket_path(socket_path), listen_fd(-1) {
+  assert (rank < world_size);
+  sockaddr_un address = MakeAddress(socket_path);
+
+  if (rank == 0) {
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path.c_str());
+    if (listen_fd < 0 || ::bind(listen_fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd, world_size) != 0) {
+      cerr << "ERROR: Unable to listen on " << socket_path << endl;
+      exit(1);
+    }
+    peer_fds.resize(world_size - 1, -1);
+    cerr << "Waiting for " << world_size - 1 << " other training processes on " << socket_path << endl;
+    for (unsigned i = 1; i < world_size; ++i) {
+      int fd = accept(listen_fd, NULL, NULL);
+      if (fd < 0) {
+        cerr << "ERROR: Unable to accept a connection on " << socket_path << endl;
+        exit(1);
+      }
+      unsigned peer_rank;
+      ReadAll(fd, &peer_rank, sizeof(peer_rank));
+      if (peer_rank == 0 || peer_rank >= world_size || peer_fds[peer_rank - 1] != -1) {
+        cerr << "ERROR: Unexpected connection from a process with rank " << peer_rank << endl;
+        exit(1);
+      }
+      peer_fds[peer_rank - 1] = fd;
+    }
+  }
+  else {
+    // Process 0 may not be listening yet, so keep trying for a minute
+    int fd = -1;
+    for (unsigned attempt = 0; attempt < 600; ++attempt) {
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (connect(fd, (sockaddr*)&address, sizeof(address)) == 0) {
+        break;
+      }
+      close(fd);
+      fd = -1;
+      usleep(100000);
+    }
+    if (fd < 0) {
+      cerr << "ERROR: Unable to connect to " << socket_path << endl;
+      exit(1);
+    }
+    WriteAll(fd, &rank, sizeof(rank));
+    peer_fds.push_back(fd);
+  }
+  cerr << "Training process " << rank << " of " << world_size << " connected" << endl;
+}
+
+ParameterAverager::~ParameterAverager() {
+  for (int fd : peer_fds) {
+    close(fd);
+  }
+  if (listen_fd >= 0) {
+    close(listen_fd);
+    unlink(socket_path.c_str());
+  }
+}
+
+// Every process contributes values and a stop flag. Process 0 adds them up (and divides
+// by world_size if average is set), then sends the result back to everyone.
+template <typename T>
+bool ParameterAverager::AllReduce(vector<T>& values, bool stop, bool average) {
+  char flag = stop ? 1 : 0;
+  if (rank == 0) {
+    vector<T> peer_values(values.size());
+    for (int fd : peer_fds) {
+      char peer_flag;
+      ReadAll(fd, &peer_flag, sizeof(peer_flag));
+      ReadAll(fd, peer_values.data(), peer_values.size() * sizeof(T));
+      flag |= peer_flag;
+      for (unsigned i = 0; i < values.size(); ++i) {
+        values[i] += peer_values[i];
+      }
+    }
+    if (average) {
+      for (unsigned i = 0; i < values.size(); ++i) {
+        values[i] /= world_size;
+      }
+    }
+    for (int fd : peer_fds) {
+      WriteAll(fd, &flag, sizeof(flag));
+      WriteAll(fd, values.data(), values.size() * sizeof(T));
+    }
+  }
+  else {
+    int fd = peer_fds[0];
+    WriteAll(fd, &flag, sizeof(flag));
+    WriteAll(fd, values.data(), values.size() * sizeof(T));
+    ReadAll(fd, &flag, sizeof(flag));
+    ReadAll(fd, values.data(), values.size() * sizeof(T));
+  }
+  return flag != 0;
+}
+
+void ParameterAverager::Flatten(Model& model) {
+  buffer.clear();
+  for (Parameters* p : model.parameters_list()) {
+    buffer.insert(buffer.end(), p->values.v, p->values.v + p->values.d.size());
+  }
+  for (LookupParameters* p : model.lookup_parameters_list()) {
+    for (const Tensor& t : p->values) {
+      buffer.insert(buffer.end(), t.v, t.v + t.d.size());
+    }
+  }
+}
+
+void ParameterAverager::Unflatten(Model& model) {
+  const float* next = buffer.data();
+  for (Parameters* p : model.parameters_list()) {
+    memcpy(p->values.v, next, p->values.d.size() * sizeof(float));
+    next += p->values.d.size();
+  }
+  for (LookupParameters* p : model.lookup_parameters_list()) {
+    for (Tensor& t : p->values) {
+      memcpy(t.v, next, t.d.size() * sizeof(float));
+      next += t.d.size();
+    }
+  }
+}
+
+bool ParameterAverager::Average(Model& model, bool stop) {
+  if (world_size == 1) {
+    return stop;
+  }
+
+  // Flatten every parameter into one buffer, average it, and copy it back
+  Flatten(model);
+  stop = AllReduce(buffer, stop, true);
+  Unflatten(model);
+  return stop;
+}
+
+void ParameterAverager::Broadcast(Model& model) {
+  if (world_size == 1) {
+    return;
+  }
+
+  // Every process has the same parameter shapes, so the buffer sizes agree
+  Flatten(model);
+  if (rank == 0) {
+    for (int fd : peer_fds) {
+      WriteAll(fd, buffer.data(), buffer.size() * sizeof(float));
+    }
+  }
+  else {
+    ReadAll(peer_fds[0], buffer.data(), buffer.size() * sizeof(float));
+    Unflatten(model);
+  }
+}
+
+double ParameterAverager::Sum(double value) {
+  vector<double> values(1, value);
+  AllReduce(values, false, false);
+  return values[0];
+}
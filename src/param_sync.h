@@ -0,0 +1,42 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "cnn/cnn.h"
+
+using namespace std;
+using namespace cnn;
+
+// Keeps the parameters of several cooperating training processes in sync.
+// Process 0 listens on a Unix domain socket and every other process connects to it.
+// At each synchronization point every process sends its parameters to process 0,
+// which averages them and sends the average back, so that all processes continue
+// training from the same point.
+class ParameterAverager {
+public:
+  unsigned rank;
+  unsigned world_size;
+
+  ParameterAverager(const string& socket_path, unsigned rank, unsigned world_size);
+  ~ParameterAverager();
+
+  // Replaces the parameters of model with their average across all processes.
+  // Returns true if any process asked to stop (e.g. because Ctrl-C was pressed).
+  bool Average(Model& model, bool stop);
+
+  // Replaces the parameters of model with those of process 0, on every process.
+  void Broadcast(Model& model);
+
+  // Returns the sum of value across all processes, to every process.
+  double Sum(double value);
+
+private:
+  template <typename T> bool AllReduce(vector<T>& values, bool stop, bool average);
+  // Copy every parameter of model into buffer, and back
+  void Flatten(Model& model);
+  void Unflatten(Model& model);
+
+  string socket_path;
+  int listen_fd;
+  vector<int> peer_fds; // On process 0, the socket of each other process. Elsewhere, the socket to process 0.
+  vector<float> buffer;
+};
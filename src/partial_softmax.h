@@ -0,0 +1,95 @@
+#pragma once
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include <vector>
+#include <Eigen/Core>
+#include "kbestlist.h"
+
+using namespace std;
+
+// Decoding only needs a few entries of the softmax over the target vocabulary, so these
+// work on the logits directly instead of materializing log probabilities. Logits are
+// processed in blocks small enough to stay in L1 cache; within a block the max and
+// the sum of exponentials are Eigen array expressions, which Eigen vectorizes.
+
+const unsigned kSoftmaxBlockSize = 256;
+
+// Returns log(sum_i exp(logits[i])) and, in the same pass, adds the indices of the
+// top->max_size highest logits to *top, scored by their logits. Subtract the returned
+// normalizer from those scores to get log probabilities.
+template <typename Index>
+float LogSumExpTopK(const float* logits, unsigned count, KBestList<Index>* top) {
+  assert (count > 0);
+  unsigned filled = 0;
+  for (; filled < count && top->size() < top->max_size; ++filled) {
+    top->add(logits[filled], (Index)filled);
+  }
+  float threshold = top->threshold();
+
+  float running_max = logits[0];
+  double running_sum = 0.0;
+  for (unsigned start = 0; start < count; start += kSoftmaxBlockSize) {
+    const unsigned size = min(kSoftmaxBlockSize, count - start);
+    Eigen::Map<const Eigen::ArrayXf> block(logits + start, size);
+    const float block_max = block.maxCoeff();
+    if (block_max > running_max) {
+      running_sum *= exp((double)running_max - block_max);
+      running_max = block_max;
+    }
+    running_sum += (block - running_max).exp().sum();
+
+    if (block_max > threshold) {
+      for (unsigned j = max(start, filled); j < start + size; ++j) {
+        if (logits[j] > threshold) {
+          top->add(logits[j], (Index)j);
+          threshold = top->threshold();
+        }
+      }
+    }
+  }
+  return running_max + log(running_sum);
+}
+
+// Returns log(sum_i exp(logits[i]))
+inline float LogSumExp(const float* logits, unsigned count) {
+  KBestList<unsigned> none(0);
+  return LogSumExpTopK(logits, count, &none);
+}
+
+// Returns index i with probability exp(logits[i]) / sum_j exp(logits[j]), where u is
+// uniform in [0, 1), and sets *log_prob to the log of that probability. One vectorized
+// pass builds the cumulative mass of each block in *block_cdf (scratch space, reused
+// across calls), a binary search finds the block holding the sample, and only that
+// block is scanned entry by entry. Only count + kSoftmaxBlockSize exponentials are taken.
+inline unsigned SampleFromLogits(const float* logits, unsigned count, double u, vector<double>* block_cdf, float* log_prob) {
+  assert (count > 0);
+  const float max_logit = Eigen::Map<const Eigen::ArrayXf>(logits, count).maxCoeff();
+  const unsigned block_count = (count + kSoftmaxBlockSize - 1) / kSoftmaxBlockSize;
+  block_cdf->resize(block_count);
+  double total = 0.0;
+  for (unsigned b = 0; b < block_count; ++b) {
+    const unsigned start = b * kSoftmaxBlockSize;
+    const unsigned size = min(kSoftmaxBlockSize, count - start);
+    Eigen::Map<const Eigen::ArrayXf> block(logits + start, size);
+    total += (block - max_logit).exp().sum();
+    (*block_cdf)[b] = total;
+  }
+
+  double target = u * total;
+  const unsigned b = min((unsigned)(upper_bound(block_cdf->begin(), block_cdf->end(), target) - block_cdf->begin()), block_count - 1);
+  const unsigned start = b * kSoftmaxBlockSize;
+  const unsigned end = min(start + kSoftmaxBlockSize, count);
+  target -= (b > 0) ? (*block_cdf)[b - 1] : 0.0;
+  // The last entry of the block also catches anything left over through rounding
+  unsigned sample = end - 1;
+  for (unsigned j = start; j < end - 1; ++j) {
+    target -= exp(logits[j] - max_logit);
+    if (target < 0.0) {
+      sample = j;
+      break;
+    }
+  }
+  *log_prob = logits[sample] - max_logit - log(total);
+  return sample;
+}
@@ -1,17 +1,31 @@
 #include "cnn/cnn.h"
 #include "cnn/training.h"
 
-#include <boost/archive/text_iarchive.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/join.hpp>
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <cstring>
 #include <csignal>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "bitext.h"
 #include "attentional.h"
+#include "model_io.h"
 #include "utils.h"
+#include "shortlist.h"
+#include "worker_pool.h"
+#include "inference.h"
 #include <boost/program_options/parsers.hpp>
 #include <boost/program_options/variables_map.hpp>
 
@@ -28,14 +42,232 @@ void ctrlc_handler(int signal) {
   }
 }
 
-void trim(vector<string>& tokens, bool removeEmpty) {
-  for (unsigned i = 0; i < tokens.size(); ++i) {
-    boost::algorithm::trim(tokens[i]);
-    if (tokens[i].length() == 0 && removeEmpty) {
-      tokens.erase(tokens.begin() + i);
-      --i;
+string FormatKBest(const vector<pair<double, vector<WordId> > >& kbest, unsigned line_id, Dict& target_vocab) {
+  ostringstream output;
+  unsigned kbest_id=0;
+  for (auto& scored_hyp : kbest) {
+    double score = scored_hyp.first;
+    const vector<WordId>& hyp = scored_hyp.second;
+    vector<string> words(hyp.size());
+    for (unsigned i = 0; i < hyp.size(); ++i) {
+      words[i] = target_vocab.Convert(hyp[i]);
     }
+    string translation = boost::algorithm::join(words, " ");
+    output << line_id << " " << kbest_id << " " << score << "\t" << translation << endl;
+    ++kbest_id;
   }
+  return output.str();
+}
+
+// A sentence submitted to the translation server, waiting to be decoded
+struct TranslationRequest {
+  vector<WordId> source;
+  unsigned beam_size;
+  unsigned kbest_size;
+  unsigned max_length;
+  chrono::steady_clock::time_point arrival;
+  KBestList<vector<WordId> > kbest = KBestList<vector<WordId> >(0);
+  bool done = false;
+};
+
+// State shared between the connection threads and the decoder loop of the server
+struct RequestQueue {
+  mutex m;
+  condition_variable arrived;
+  condition_variable finished;
+  deque<shared_ptr<TranslationRequest> > pending;
+};
+
+// Parses a server request line: "source words ||| beam_size=B kbest_size=K max_length=M".
+// The options are all optional. Returns false and sets *error if the line is malformed.
+bool ParseRequest(const string& line, Dict& source_vocab, WordId ksSOS, WordId ksEOS, TranslationRequest* request, string* error) {
+  vector<boost::string_ref> parts;
+  vector<boost::string_ref> tokens;
+  split_fields(line, "|||", &parts);
+  split_words(parts[0], &tokens);
+  request->source.clear();
+  request->source.push_back(ksSOS);
+  string token;
+  for (boost::string_ref t : tokens) {
+    token.assign(t.data(), t.size());
+    if (!source_vocab.Contains(token)) {
+      *error = "unknown source word " + token;
+      return false;
+    }
+    request->source.push_back(source_vocab.Convert(token));
+  }
+  request->source.push_back(ksEOS);
+
+  if (parts.size() > 1) {
+    split_words(parts[1], &tokens);
+    for (boost::string_ref option : tokens) {
+      const size_t equals = option.find('=');
+      const boost::string_ref name = option.substr(0, equals);
+      const boost::string_ref value_text = (equals == boost::string_ref::npos) ? boost::string_ref() : option.substr(equals + 1);
+      if (equals == boost::string_ref::npos || value_text.empty() || value_text.find_first_not_of("0123456789") != boost::string_ref::npos) {
+        *error = "invalid option " + option.to_string();
+        return false;
+      }
+      unsigned value = stoul(value_text.to_string());
+      if (name == "beam_size") {
+        request->beam_size = value;
+      }
+      else if (name == "kbest_size") {
+        request->kbest_size = value;
+      }
+      else if (name == "max_length") {
+        request->max_length = value;
+      }
+      else {
+        *error = "unknown option " + name.to_string();
+        return false;
+      }
+    }
+  }
+  if (request->kbest_size == 0 || request->kbest_size > request->beam_size || request->max_length == 0) {
+    *error = "kbest_size must be between 1 and beam_size, and max_length must be positive";
+    return false;
+  }
+  return true;
+}
+
+// Serves one client: each line it sends is a request, answered by the n-best list
+// followed by an empty line (or by a single "ERROR: ..." line and an empty line).
+void ServeConnection(int fd, RequestQueue& queue, Dict& source_vocab, Dict& target_vocab, WordId ksSOS, WordId ksEOS,
+    unsigned beam_size, unsigned kbest_size, unsigned max_length) {
+  string buffer;
+  char chunk[4096];
+  unsigned line_id = 0;
+  while (true) {
+    size_t newline = buffer.find('\n');
+    if (newline == string::npos) {
+      ssize_t n = read(fd, chunk, sizeof(chunk));
+      if (n <= 0) {
+        break;
+      }
+      buffer.append(chunk, n);
+      continue;
+    }
+    string line = buffer.substr(0, newline);
+    buffer.erase(0, newline + 1);
+
+    auto request = make_shared<TranslationRequest>();
+    request->beam_size = beam_size;
+    request->kbest_size = kbest_size;
+    request->max_length = max_length;
+    string response, error;
+    if (ParseRequest(line, source_vocab, ksSOS, ksEOS, request.get(), &error)) {
+      unique_lock<mutex> lock(queue.m);
+      request->arrival = chrono::steady_clock::now();
+      queue.pending.push_back(request);
+      queue.arrived.notify_one();
+      queue.finished.wait(lock, [&]{ return request->done; });
+      lock.unlock();
+      response = FormatKBest(request->kbest.hypothesis_list(), line_id, target_vocab) + "\n";
+    }
+    else {
+      response = "ERROR: " + error + "\n\n";
+    }
+    if (write(fd, response.data(), response.size()) != (ssize_t)response.size()) {
+      break;
+    }
+    ++line_id;
+  }
+  close(fd);
+}
+
+// Listens on a Unix domain socket and translates requests from any number of clients.
+// Requests that arrive within max_batch_delay_ms of each other (and share the same
+// decoding options) are decoded together, up to max_batch_size sentences at a time.
+// If inference_model is given, the sentences of a batch are decoded one at a time with it instead.
+void RunServer(const string& socket_path, unsigned max_batch_size, unsigned max_batch_delay_ms, AttentionalModel& attentional_model,
+    const InferenceModel* inference_model, Dict& source_vocab, Dict& target_vocab, WordId ksSOS, WordId ksEOS, WordId ktSOS, WordId ktEOS,
+    unsigned beam_size, unsigned kbest_size, unsigned max_length, const Shortlist* shortlist) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    cerr << "ERROR: Socket path " << socket_path << " is too long" << endl;
+    exit(1);
+  }
+  strcpy(address.sun_path, socket_path.c_str());
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socket_path.c_str());
+  if (listen_fd < 0 || ::bind(listen_fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd, 64) != 0) {
+    cerr << "ERROR: Unable to listen on " << socket_path << endl;
+    exit(1);
+  }
+  cerr << "Listening on " << socket_path << endl;
+
+  RequestQueue queue;
+  thread acceptor([&]() {
+    while (true) {
+      int fd = accept(listen_fd, NULL, NULL);
+      if (fd < 0) {
+        continue;
+      }
+      thread(ServeConnection, fd, ref(queue), ref(source_vocab), ref(target_vocab), ksSOS, ksEOS, beam_size, kbest_size, max_length).detach();
+    }
+  });
+  acceptor.detach();
+
+  // cnn supports one ComputationGraph per process, so all decoding happens on this thread
+  const chrono::milliseconds max_batch_delay(max_batch_delay_ms);
+  while (!ctrlc_pressed) {
+    vector<shared_ptr<TranslationRequest> > batch;
+    {
+      unique_lock<mutex> lock(queue.m);
+      if (!queue.arrived.wait_for(lock, chrono::milliseconds(500), [&]{ return !queue.pending.empty(); })) {
+        continue;
+      }
+      auto deadline = queue.pending.front()->arrival + max_batch_delay;
+      queue.arrived.wait_until(lock, deadline, [&]{ return queue.pending.size() >= max_batch_size; });
+
+      // Take the oldest request and every other pending one with the same options
+      const TranslationRequest& first = *queue.pending.front();
+      for (auto it = queue.pending.begin(); it != queue.pending.end() && batch.size() < max_batch_size; ) {
+        const TranslationRequest& r = **it;
+        if (r.beam_size == first.beam_size && r.kbest_size == first.kbest_size && r.max_length == first.max_length) {
+          batch.push_back(*it);
+          it = queue.pending.erase(it);
+        }
+        else {
+          ++it;
+        }
+      }
+    }
+
+    vector<vector<WordId> > sources(batch.size());
+    for (unsigned i = 0; i < batch.size(); ++i) {
+      sources[i] = batch[i]->source;
+    }
+    vector<KBestList<vector<WordId> > > kbests;
+    if (inference_model != nullptr) {
+      for (const vector<WordId>& source : sources) {
+        const vector<unsigned> words = (shortlist != nullptr) ? shortlist->Build(vector<vector<WordId> >(1, source)) : vector<unsigned>();
+        kbests.push_back(inference_model->TranslateKBest(source, ktSOS, ktEOS,
+            batch[0]->kbest_size, batch[0]->beam_size, batch[0]->max_length, (shortlist != nullptr) ? &words : NULL));
+      }
+    }
+    else {
+      // A batch is decoded in one graph, so it shares one shortlist: the union of its sentences'
+      const vector<unsigned> words = (shortlist != nullptr) ? shortlist->Build(sources) : vector<unsigned>();
+      kbests = attentional_model.TranslateKBest(sources, ktSOS, ktEOS,
+          batch[0]->kbest_size, batch[0]->beam_size, batch[0]->max_length, (shortlist != nullptr) ? &words : NULL);
+    }
+
+    {
+      lock_guard<mutex> lock(queue.m);
+      for (unsigned i = 0; i < batch.size(); ++i) {
+        batch[i]->kbest = kbests[i];
+        batch[i]->done = true;
+      }
+    }
+    queue.finished.notify_all();
+  }
+
+  close(listen_fd);
+  unlink(socket_path.c_str());
 }
 
 int main(int argc, char** argv) {
@@ -48,6 +280,17 @@ int main(int argc, char** argv) {
     ("beam_size,b", po::value<unsigned>()->default_value(10),"beam size")
     ("max_length,m", po::value<unsigned>()->default_value(20),"max length of translation")
     ("kbest_size,k", po::value<unsigned>()->default_value(10),"kbest list size")
+    ("threads,j", po::value<unsigned>()->default_value(1),"number of decoder processes")
+    ("listen", po::value<string>(),"run as a server on this Unix domain socket instead of reading stdin")
+    ("max_batch_size", po::value<unsigned>()->default_value(16),"server mode: max number of requests decoded together")
+    ("max_batch_delay", po::value<unsigned>()->default_value(10),"server mode: max milliseconds to wait for a batch to fill up")
+    ("shortlist_frequent", po::value<string>(),"only score a shortlist of target words: the most frequent ones from this file (word count per line)")
+    ("shortlist_lexicon", po::value<string>(),"only score a shortlist of target words: the translation candidates of the source words from this file (source target score per line)")
+    ("shortlist_size", po::value<unsigned>()->default_value(2000),"number of frequent target words in the shortlist")
+    ("shortlist_candidates", po::value<unsigned>()->default_value(20),"number of translation candidates per source word in the shortlist")
+    ("samples", po::value<unsigned>()->default_value(0),"output this many translations sampled from the model instead of the k-best list")
+    ("sample_batch_size", po::value<unsigned>()->default_value(32),"number of samples drawn together in one graph")
+    ("forward_only", "decode k-best lists with the forward-only engine (see inference.h) instead of a computation graph. In server mode, sentences are then decoded one at a time.")
     ;
   po::store(po::parse_command_line(argc, argv, opts), vm);
   po::notify(vm);
@@ -56,29 +299,28 @@ int main(int argc, char** argv) {
     cerr << opts << endl;
     exit(1);
   }
-  signal (SIGINT, ctrlc_handler);
-
-  const string model_filename = argv[1];
-  ifstream model_file(model_filename);
-  if (!model_file.is_open()) {
-    cerr << "ERROR: Unable to open " << model_filename << endl;
+  if (vm.count("forward_only") && vm["samples"].as<unsigned>() > 0) {
+    cerr << "ERROR: The forward-only engine only decodes k-best lists, it cannot be combined with --samples" << endl;
     exit(1);
   }
-  boost::archive::text_iarchive ia(model_file);
+  signal (SIGINT, ctrlc_handler);
 
+  const string model_filename = argv[1];
   cnn::Initialize(argc, argv);
   Dict source_vocab;
   Dict target_vocab;
-  ia & source_vocab;
-  ia & target_vocab;
-  source_vocab.Freeze();
-  target_vocab.Freeze();
-
   Model model;
   AttentionalModel attentional_model;
-  ia & attentional_model;
-  attentional_model.Initialize(model, source_vocab.size(), target_vocab.size());
-  ia & model;
+  if (!LoadModel(model_filename, source_vocab, target_vocab, attentional_model, model)) {
+    cerr << "ERROR: Unable to open " << model_filename << endl;
+    exit(1);
+  }
+
+  // Binds the model's parameters once, for every sentence decoded by this process and its workers
+  unique_ptr<InferenceModel> inference_model;
+  if (vm.count("forward_only")) {
+    inference_model.reset(new InferenceModel(attentional_model));
+  }
 
   WordId ksSOS = source_vocab.Convert("<s>");
   WordId ksEOS = source_vocab.Convert("</s>");
@@ -87,79 +329,88 @@ int main(int argc, char** argv) {
   unsigned beam_size = vm["beam_size"].as<unsigned>();
   unsigned max_length = vm["max_length"].as<unsigned>();
   unsigned kbest_size = vm["kbest_size"].as<unsigned>();
+  unsigned sample_count = vm["samples"].as<unsigned>();
+  unsigned sample_batch_size = max(vm["sample_batch_size"].as<unsigned>(), 1U);
 
+  Shortlist* shortlist = nullptr;
+  if (vm.count("shortlist_frequent") || vm.count("shortlist_lexicon")) {
+    const string frequent_filename = vm.count("shortlist_frequent") ? vm["shortlist_frequent"].as<string>() : "";
+    const string lexicon_filename = vm.count("shortlist_lexicon") ? vm["shortlist_lexicon"].as<string>() : "";
+    shortlist = new Shortlist();
+    if (!shortlist->Load(frequent_filename, lexicon_filename, source_vocab, target_vocab,
+        vm["shortlist_size"].as<unsigned>(), vm["shortlist_candidates"].as<unsigned>())) {
+      cerr << "ERROR: Unable to read the shortlist tables" << endl;
+      exit(1);
+    }
+  }
 
-  string line;
-  unsigned line_id = 0;
-  for (; getline(cin, line);) {
-    vector<string> parts = tokenize(line, "|||");
-    trim(parts, false);
+  // Returns the n-best list for one input line, in the same format as it is written to stdout
+  auto translate_line = [&](const string& line, unsigned line_id) {
+    vector<boost::string_ref> parts;
+    vector<boost::string_ref> tokens;
+    split_fields(line, "|||", &parts);
+    split_words(parts[0], &tokens);
 
-    vector<string> tokens = tokenize(parts[0], " ");
-    trim(tokens, true);
+    vector<WordId> source;
+    source.reserve(tokens.size() + 2);
+    source.push_back(ksSOS);
+    convert_words(tokens, source_vocab, &source);
+    source.push_back(ksEOS);
 
-    vector<WordId> source(tokens.size());
-    for (unsigned i = 0; i < tokens.size(); ++i) {
-      source[i] = source_vocab.Convert(tokens[i]);
+    cerr << "Read source sentence: " << join_words(tokens) << endl;
+    if (parts.size() > 1) {
+      split_words(parts[1], &tokens);
+      cerr << "  Read reference: " << join_words(tokens) << endl;
     }
-    source.insert(source.begin(), ksSOS);
-    source.insert(source.end(), ksEOS);
 
-    cerr << "Read source sentence: " << boost::algorithm::join(tokens, " ") << endl;
-    if (parts.size() > 1) {
-      vector<string> reference = tokenize(parts[1], " ");
-      trim(reference, true);
-      cerr << "  Read reference: " << boost::algorithm::join(reference, " ") << endl;
-    }
-
-    KBestList<vector<WordId> > kbest = attentional_model.TranslateKBest(source, ktSOS, ktEOS, kbest_size, beam_size, max_length);
-    unsigned kbest_id=0;
-    for (auto& scored_hyp : kbest.hypothesis_list()) {
-      double score = scored_hyp.first;
-      vector<WordId> hyp = scored_hyp.second;
-      vector<string> words(hyp.size());
-      for (unsigned i = 0; i < hyp.size(); ++i) {
-        words[i] = target_vocab.Convert(hyp[i]);
-      }
-      string translation = boost::algorithm::join(words, " ");
-      cerr << line_id << " " << kbest_id << " " << score << "\t" << translation << endl;
-      cout << line_id << " " << kbest_id << " " << score << "\t" << translation << endl;
-      ++kbest_id;
-    }
-    
-
-    // TODO: Work with sampling later. Just beam search now
-    /**
-    map<string, int> translations;
-    for (unsigned j = 0; j < 1000; ++j) {
-      vector<WordId> target = attentional_model.SampleTranslation(source, ktSOS, ktEOS, 10);
-      vector<string> words(target.size());
-      for  (unsigned i = 0; i < target.size(); ++i) {
-        words[i] = target_vocab.Convert(target[i]);
+    string output;
+    if (sample_count > 0) {
+      // Samples are listed in the order they were drawn, scored by their log probabilities
+      vector<double> log_probs;
+      vector<vector<WordId> > samples = attentional_model.SampleTranslations(source, ktSOS, ktEOS, sample_count, max_length, sample_batch_size, &log_probs);
+      vector<pair<double, vector<WordId> > > scored_samples(samples.size());
+      for (unsigned i = 0; i < samples.size(); ++i) {
+        scored_samples[i] = make_pair(log_probs[i], move(samples[i]));
       }
-      string translation = boost::algorithm::join(words, " ");
-      translations[translation]++;
-
-      if (ctrlc_pressed) {
-        break;
+      output = FormatKBest(scored_samples, line_id, target_vocab);
+    }
+    else {
+      vector<unsigned> words;
+      if (shortlist != nullptr) {
+        words = shortlist->Build(vector<vector<WordId> >(1, source));
       }
+      const vector<unsigned>* shortlist_words = (shortlist != nullptr) ? &words : NULL;
+      KBestList<vector<WordId> > kbest = inference_model ?
+          inference_model->TranslateKBest(source, ktSOS, ktEOS, kbest_size, beam_size, max_length, shortlist_words) :
+          attentional_model.TranslateKBest(source, ktSOS, ktEOS, kbest_size, beam_size, max_length, shortlist_words);
+      output = FormatKBest(kbest.hypothesis_list(), line_id, target_vocab);
     }
+    cerr << output;
+    return output;
+  };
 
-    vector<pair<int, string> > translations2;
-    for (auto it = translations.begin(); it != translations.end(); ++it) {
-      translations2.push_back(make_pair(it->second, it->first));
-    }
+  if (vm.count("listen")) {
+    RunServer(vm["listen"].as<string>(), vm["max_batch_size"].as<unsigned>(), vm["max_batch_delay"].as<unsigned>(), attentional_model,
+        inference_model.get(), source_vocab, target_vocab, ksSOS, ksEOS, ktSOS, ktEOS, beam_size, kbest_size, max_length, shortlist);
+    return 0;
+  }
 
-    auto comp = [](const pair<int,string>& a, const pair<int,string>& b) { return a.first > b.first || (a.first == b.first && a.second < b.second);};
-    sort(translations2.begin(), translations2.end(), comp);
+  unsigned thread_count = vm["threads"].as<unsigned>();
+  if (thread_count > 1) {
+    // Each decoder is a forked process, see worker_pool.h. Lines are read and written in input order.
+    RunWorkers(thread_count, [](string* line) { return (bool)getline(cin, *line); }, translate_line,
+        [](const string& result) { cout << result << flush; });
+    return 0;
+  }
 
-    for (auto it = translations2.begin(); it != translations2.end(); ++it) {
-      cout << it->first << "\t" << it->second << endl;
-    }
-    **/
+  string line;
+  unsigned line_id = 0;
+  for (; getline(cin, line);) {
+    cout << translate_line(line, line_id) << flush;
 
     ++line_id;
   }
 
+  delete shortlist;
   return 0;
 }
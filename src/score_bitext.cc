@@ -1,16 +1,25 @@
 #include "cnn/cnn.h"
 #include "cnn/training.h"
 
-#include <boost/archive/text_iarchive.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/join.hpp>
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <cmath>
+#include <memory>
+#include <chrono>
+#include <numeric>
+#include <algorithm>
 
 #include "bitext.h"
 #include "attentional.h"
+#include "model_io.h"
 #include "utils.h"
+#include "worker_pool.h"
+#include "inference.h"
 #include <boost/program_options/parsers.hpp>
 #include <boost/program_options/variables_map.hpp>
 
@@ -18,16 +27,6 @@ using namespace cnn;
 using namespace std;
 
 
-void trim(vector<string>& tokens, bool removeEmpty) {
-  for (unsigned i = 0; i < tokens.size(); ++i) {
-    boost::algorithm::trim(tokens[i]);
-    if (tokens[i].length() == 0 && removeEmpty) {
-      tokens.erase(tokens.begin() + i);
-      --i;
-    }
-  }
-}
-
 int main(int argc, char** argv) {
  
   namespace po = boost::program_options;
@@ -36,6 +35,11 @@ int main(int argc, char** argv) {
   opts.add_options()
     ("help","print help message")
     ("reverse,r", po::value<bool>()->default_value(false), "reverse source/target in input")
+    ("batch_size,b", po::value<unsigned>()->default_value(1), "Max number of pairs scored together. Above 1, pairs are sorted by length within each window and scored in batches, without the per line log. The forward-only engine scores one pair at a time.")
+    ("threads,j", po::value<unsigned>()->default_value(1), "Number of scoring processes, each taking whole windows")
+    ("window", po::value<unsigned>()->default_value(10000), "Number of lines sorted by length together when batching")
+    ("forward_only", "Score with the forward-only engine (see inference.h) instead of a computation graph")
+    ("check_forward_only", "Score line by line with both the computation graph and the forward-only engine, and report lines where they disagree")
     ;
   po::store(po::parse_command_line(argc, argv, opts), vm);
   po::notify(vm);
@@ -47,72 +51,229 @@ int main(int argc, char** argv) {
 
 
   const string model_filename = argv[1];
-  ifstream model_file(model_filename);
-  if (!model_file.is_open()) {
-    cerr << "ERROR: Unable to open " << model_filename << endl;
-    exit(1);
-  }
-  boost::archive::text_iarchive ia(model_file);
-
   cnn::Initialize(argc, argv);
   Dict source_vocab;
   Dict target_vocab;
-  ia & source_vocab;
-  ia & target_vocab;
-  source_vocab.Freeze();
-  target_vocab.Freeze();
-
   Model model;
   AttentionalModel attentional_model;
-  ia & attentional_model;
-  attentional_model.Initialize(model, source_vocab.size(), target_vocab.size());
-  ia & model;
+  if (!LoadModel(model_filename, source_vocab, target_vocab, attentional_model, model)) {
+    cerr << "ERROR: Unable to open " << model_filename << endl;
+    exit(1);
+  }
 
   WordId ksSOS = source_vocab.Convert("<s>");
   WordId ksEOS = source_vocab.Convert("</s>");
   WordId ktSOS = target_vocab.Convert("<s>");
   WordId ktEOS = target_vocab.Convert("</s>");
 
+  unique_ptr<InferenceModel> inference_model;
+  const bool check_forward_only = vm.count("check_forward_only") > 0;
+  if (vm.count("forward_only") || check_forward_only) {
+    inference_model.reset(new InferenceModel(attentional_model));
+  }
+
   unsigned column_source=0;
   unsigned column_reference=1;
   if (vm["reverse"].as<bool>()) {
     column_source=1;
     column_reference=0;
   }
-  
+
+  const unsigned batch_size = max(vm["batch_size"].as<unsigned>(), 1U);
+  const unsigned thread_count = max(vm["threads"].as<unsigned>(), 1U);
+  const unsigned window_size = max(vm["window"].as<unsigned>(), 1U);
+  if (batch_size > 1 || thread_count > 1) {
+    if (check_forward_only) {
+      cerr << "ERROR: --check_forward_only scores line by line, it cannot be combined with --batch_size or --threads above 1" << endl;
+      exit(1);
+    }
+    // Scores one window of input lines, the window_id-th. Pairs are sorted by length and
+    // scored in batches of equal source length (see BuildGraph), forward only, or one at
+    // a time by the forward-only engine. Returns the output lines in input order, preceded
+    // by a line with the pair count, the word count and the total loss of the window.
+    auto score_window = [&](const string& window, unsigned window_id) {
+      vector<boost::string_ref> parts;
+      vector<boost::string_ref> tokens;
+      vector<vector<WordId> > sources;
+      vector<vector<WordId> > references;
+      for (size_t start = 0; start < window.size(); ) {
+        size_t end = window.find('\n', start);
+        if (end == string::npos) {
+          end = window.size();
+        }
+        boost::string_ref line(window.data() + start, end - start);
+        start = end + 1;
+        split_fields(line, "|||", &parts);
+        if (parts.size() < 2) {
+          cerr << "ERROR: Expected a source and a target sentence separated by |||: " << line << endl;
+          exit(1);
+        }
+        sources.push_back(vector<WordId>(1, ksSOS));
+        split_words(parts[column_source], &tokens);
+        convert_words(tokens, source_vocab, &sources.back());
+        sources.back().push_back(ksEOS);
+        references.push_back(vector<WordId>(1, ktSOS));
+        split_words(parts[column_reference], &tokens);
+        convert_words(tokens, target_vocab, &references.back());
+        references.back().push_back(ktEOS);
+      }
+
+      const unsigned pair_count = sources.size();
+      vector<float> losses(pair_count);
+      if (inference_model) {
+        for (unsigned i = 0; i < pair_count; ++i) {
+          losses[i] = inference_model->Loss(sources[i], references[i]);
+        }
+      }
+      else {
+        vector<unsigned> order(pair_count);
+        iota(order.begin(), order.end(), 0);
+        sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+          return make_pair(sources[a].size(), references[a].size()) < make_pair(sources[b].size(), references[b].size());
+        });
+
+        vector<vector<WordId> > batch_sources;
+        vector<vector<WordId> > batch_references;
+        for (unsigned begin = 0; begin < pair_count; ) {
+          unsigned end = begin + 1;
+          while (end < pair_count && end - begin < batch_size && sources[order[end]].size() == sources[order[begin]].size()) {
+            ++end;
+          }
+          batch_sources.clear();
+          batch_references.clear();
+          for (unsigned i = begin; i < end; ++i) {
+            batch_sources.push_back(sources[order[i]]);
+            batch_references.push_back(references[order[i]]);
+          }
+          // Only the forward pass is run, so no gradient memory is ever touched
+          ComputationGraph hg;
+          attentional_model.BuildGraph(batch_sources, batch_references, hg);
+          vector<float> batch_losses = as_vector(hg.incremental_forward());
+          for (unsigned i = begin; i < end; ++i) {
+            losses[order[i]] = batch_losses[i - begin];
+          }
+          begin = end;
+        }
+      }
+
+      ostringstream output;
+      unsigned word_count = 0;
+      double loss = 0.0;
+      for (unsigned i = 0; i < pair_count; ++i) {
+        unsigned wc = references[i].size() - 1; // Minus one for <s>
+        output << (uint64_t)window_id * window_size + i << " " << losses[i] << " " << exp(losses[i] / wc) << "\n";
+        word_count += wc;
+        loss += losses[i];
+      }
+      ostringstream header;
+      header.precision(17);
+      header << pair_count << " " << word_count << " " << loss << "\n";
+      return header.str() + output.str();
+    };
+
+    auto read_window = [&](string* window) {
+      window->clear();
+      string line;
+      unsigned line_count = 0;
+      for (; line_count < window_size && getline(cin, line); ++line_count) {
+        *window += line;
+        *window += '\n';
+      }
+      return line_count > 0;
+    };
+
+    uint64_t pair_count = 0;
+    uint64_t word_count = 0;
+    double loss = 0.0;
+    auto start_time = chrono::steady_clock::now();
+    auto throughput = [&]() {
+      double seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+      ostringstream report;
+      report << pair_count / seconds << " pairs/s, " << word_count / seconds << " words/s";
+      return report.str();
+    };
+    auto write_window = [&](const string& result) {
+      size_t header_end = result.find('\n');
+      istringstream header(result.substr(0, header_end));
+      unsigned window_pairs, window_words;
+      double window_loss;
+      header >> window_pairs >> window_words >> window_loss;
+      pair_count += window_pairs;
+      word_count += window_words;
+      loss += window_loss;
+      cout << result.substr(header_end + 1) << flush;
+      cerr << "Scored " << pair_count << " pairs (" << throughput() << ")" << endl;
+    };
+
+    if (thread_count > 1) {
+      RunWorkers(thread_count, read_window, score_window, write_window);
+    }
+    else {
+      string window;
+      for (unsigned window_id = 0; read_window(&window); ++window_id) {
+        write_window(score_window(window, window_id));
+      }
+    }
+    cerr << "TOTAL loss: " << loss << " perp: " << exp(loss/word_count) << endl;
+    cerr << "Scored " << pair_count << " pairs and " << word_count << " words: " << throughput() << endl;
+    return 0;
+  }
+
   string line;
   unsigned line_id = 0;
   unsigned word_count = 0;
   double loss = 0.0;
+  vector<boost::string_ref> parts;
+  vector<boost::string_ref> tokens;
+  vector<WordId> source;
+  vector<WordId> prev_source;
+  vector<WordId> reference;
+  // Consecutive lines with the same source (e.g. an n-best list) share one graph and encoder pass
+  unique_ptr<ComputationGraph> hg;
+  EncodedSource encoded;
   for (; getline(cin, line);) {
-    vector<string> parts = tokenize(line, "|||");
-    trim(parts, false);
-
-    vector<string> tokens = tokenize(parts[column_source], " ");
-    trim(tokens, true);
-    cerr << line_id << " : " << boost::algorithm::join(tokens, " ") << " ||| ";
-    vector<WordId> source(tokens.size());
-    for (unsigned i = 0; i < tokens.size(); ++i) {
-      source[i] = source_vocab.Convert(tokens[i]);
+    split_fields(line, "|||", &parts);
+    if (parts.size() < 2) {
+      cerr << "ERROR: Expected a source and a target sentence separated by |||: " << line << endl;
+      exit(1);
     }
-    source.insert(source.begin(), ksSOS);
-    source.insert(source.end(), ksEOS);
-
-    tokens = tokenize(parts[column_reference], " ");
-    trim(tokens, true);
-    cerr << boost::algorithm::join(tokens, " ") << " ||| ";
-    vector<WordId> reference(tokens.size());
-    for (unsigned i = 0; i < tokens.size(); ++i) {
-      reference[i] = target_vocab.Convert(tokens[i]);
-    }
-    reference.insert(reference.begin(), ksSOS);
-    reference.insert(reference.end(), ksEOS);
+
+    split_words(parts[column_source], &tokens);
+    cerr << line_id << " : " << join_words(tokens) << " ||| ";
+    source.clear();
+    source.push_back(ksSOS);
+    convert_words(tokens, source_vocab, &source);
+    source.push_back(ksEOS);
+
+    split_words(parts[column_reference], &tokens);
+    cerr << join_words(tokens) << " ||| ";
+    reference.clear();
+    reference.push_back(ktSOS);
+    convert_words(tokens, target_vocab, &reference);
+    reference.push_back(ktEOS);
 
 
     unsigned wc = reference.size() - 1; // Minus one for <s>
-    ComputationGraph hg;
-    attentional_model.BuildGraph(source, reference, hg);
-    double l = as_scalar(hg.forward());
+    double l;
+    if (inference_model && !check_forward_only) {
+      l = inference_model->Loss(source, reference);
+    }
+    else {
+      if (!hg || source != prev_source) {
+        hg.reset(); // cnn allows a single graph at a time, so free the old one first
+        hg.reset(new ComputationGraph);
+        encoded = attentional_model.Encode(source, *hg);
+        prev_source = source;
+      }
+      attentional_model.BuildGraph(encoded, reference, *hg);
+      l = as_scalar(hg->incremental_forward());
+      if (check_forward_only) {
+        double forward_only_l = inference_model->Loss(source, reference);
+        if (fabs(forward_only_l - l) > 1e-4 * max(1.0, fabs(l))) {
+          cerr << "ERROR: The forward-only loss of line " << line_id << " is " << forward_only_l << ", the graph's " << l << endl;
+        }
+      }
+    }
     loss += l;
     word_count += wc;
     cerr << " loss: " << l << " perp: " << exp(l/wc) << endl;
@@ -0,0 +1,82 @@
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include "shortlist.h"
+#include "kbestlist.h"
+
+using namespace std;
+
+bool Shortlist::Load(const string& frequent_filename, const string& lexicon_filename, Dict& source_vocab, Dict& target_vocab,
+    unsigned frequent_count, unsigned candidate_count) {
+  kSOS = target_vocab.Convert("<s>");
+  kEOS = target_vocab.Convert("</s>");
+
+  if (!frequent_filename.empty()) {
+    ifstream f(frequent_filename);
+    if (!f.is_open()) {
+      return false;
+    }
+    KBestList<WordId> most_frequent(frequent_count);
+    string word;
+    double count;
+    for (string line; getline(f, line);) {
+      istringstream fields(line);
+      if (fields >> word >> count && target_vocab.Contains(word)) {
+        most_frequent.add(count, target_vocab.Convert(word));
+      }
+    }
+    for (const pair<double, WordId>& p : most_frequent.hypothesis_list()) {
+      frequent_words.push_back(p.second);
+    }
+  }
+
+  if (!lexicon_filename.empty()) {
+    ifstream f(lexicon_filename);
+    if (!f.is_open()) {
+      return false;
+    }
+    unordered_map<WordId, KBestList<WordId> > best;
+    string source_word;
+    string target_word;
+    double score;
+    for (string line; getline(f, line);) {
+      istringstream fields(line);
+      if (!(fields >> source_word >> target_word >> score)) {
+        continue;
+      }
+      if (!source_vocab.Contains(source_word) || !target_vocab.Contains(target_word)) {
+        continue;
+      }
+      WordId s = source_vocab.Convert(source_word);
+      auto it = best.find(s);
+      if (it == best.end()) {
+        it = best.insert(make_pair(s, KBestList<WordId>(candidate_count))).first;
+      }
+      it->second.add(score, target_vocab.Convert(target_word));
+    }
+    for (auto& entry : best) {
+      vector<WordId>& words = candidates[entry.first];
+      for (const pair<double, WordId>& p : entry.second.hypothesis_list()) {
+        words.push_back(p.second);
+      }
+    }
+  }
+  return true;
+}
+
+vector<unsigned> Shortlist::Build(const vector<vector<WordId> >& sources) const {
+  vector<unsigned> words(frequent_words.begin(), frequent_words.end());
+  words.push_back(kSOS);
+  words.push_back(kEOS);
+  for (const vector<WordId>& source : sources) {
+    for (WordId s : source) {
+      auto it = candidates.find(s);
+      if (it != candidates.end()) {
+        words.insert(words.end(), it->second.begin(), it->second.end());
+      }
+    }
+  }
+  sort(words.begin(), words.end());
+  words.erase(unique(words.begin(), words.end()), words.end());
+  return words;
+}
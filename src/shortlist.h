@@ -0,0 +1,36 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "cnn/dict.h"
+#include "bitext.h"
+
+using namespace std;
+using namespace cnn;
+
+// Restricts decoding to a per-sentence subset of the target vocabulary: the most
+// frequent target words, plus the likeliest translations of each source word.
+// Only the rows of the output layer for those words are then scored.
+//
+// Both tables are plain text, as written by bin/build_shortlist:
+//   frequent words: "target_word count" per line
+//   lexicon: "source_word target_word score" per line, higher scores being better
+// Words that are not in the model's vocabularies are ignored.
+class Shortlist {
+public:
+  // Either filename may be empty. Keeps the frequent_count most frequent words and the
+  // candidate_count best translations of each source word. Returns false if a file
+  // cannot be opened.
+  bool Load(const string& frequent_filename, const string& lexicon_filename, Dict& source_vocab, Dict& target_vocab,
+      unsigned frequent_count, unsigned candidate_count);
+
+  // Returns the sorted target word ids to score when translating any of sources.
+  // Always contains <s> and </s>.
+  vector<unsigned> Build(const vector<vector<WordId> >& sources) const;
+
+private:
+  vector<WordId> frequent_words;
+  unordered_map<WordId, vector<WordId> > candidates; // Keyed by source word id
+  WordId kSOS;
+  WordId kEOS;
+};
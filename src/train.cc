@@ -10,11 +10,21 @@
 #include <fstream>
 #include <csignal>
 #include <algorithm>
+#include <map>
+#include <sstream>
+#include <functional>
+#include <thread>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "bitext.h"
 #include "attentional.h"
+#include "param_sync.h"
+#include "model_io.h"
+#include "checkpoint.h"
 
 using namespace cnn;
+using namespace cnn::expr;
 using namespace std;
 
 bool ctrlc_pressed = false;
@@ -29,21 +39,173 @@ void ctrlc_handler(int signal) {
   }
 }
 
+// Shuffles the corpus and groups sentence pairs into minibatches of at most minibatch_size
+// pairs. Pairs are bucketed by source length, so the encoders never see padding. The order
+// of the minibatches is shuffled too. The result only depends on the state of g, so an
+// epoch can be replayed from a checkpoint.
 template <class RNG>
-void shuffle(Bitext& bitext, RNG& g) {
-  vector<unsigned> indices(bitext.size(), 0);
+vector<vector<unsigned> > MakeMinibatches(const Bitext& bitext, unsigned minibatch_size, RNG& g) {
+  vector<unsigned> order(bitext.size());
   for (unsigned i = 0; i < bitext.size(); ++i) {
-    indices[i] = i;
+    order[i] = i;
   }
-  shuffle(indices.begin(), indices.end(), g);
-  vector<vector<WordId> > source(bitext.size());
-  vector<vector<WordId> > target(bitext.size());
+  shuffle(order.begin(), order.end(), g);
+
+  map<unsigned, vector<unsigned> > buckets;
+  for (unsigned i : order) {
+    buckets[bitext.source(i).size()].push_back(i);
+  }
+
+  vector<vector<unsigned> > minibatches;
+  for (auto& bucket : buckets) {
+    const vector<unsigned>& indices = bucket.second;
+    for (unsigned start = 0; start < indices.size(); start += minibatch_size) {
+      unsigned end = min(start + minibatch_size, (unsigned)indices.size());
+      minibatches.push_back(vector<unsigned>(indices.begin() + start, indices.begin() + end));
+    }
+  }
+  shuffle(minibatches.begin(), minibatches.end(), g);
+  return minibatches;
+}
+
+// Trains on minibatches first, first + stride, ... up to (not including) last,
+// and adds the loss and the number of target words seen to *loss and *word_count.
+// If given, after_minibatch is called with the index of each minibatch once it has been trained on.
+void TrainMinibatches(AttentionalModel& attentional_model, Trainer* sgd, const Bitext& bitext, const vector<vector<unsigned> >& minibatches,
+    unsigned first, unsigned last, unsigned stride, unsigned iteration, double* loss, unsigned* word_count,
+    const function<void(unsigned)>& after_minibatch = nullptr) {
+  unsigned tword_count = 0;
+  double tloss = 0.0;
+  unsigned sentence_count = 0;
+  unsigned report_count = 0;
+  for (unsigned i = first; i < last; i += stride) {
+    const vector<unsigned>& minibatch = minibatches[i];
+    vector<vector<WordId> > source_sentences(minibatch.size());
+    vector<vector<WordId> > target_sentences(minibatch.size());
+    for (unsigned j = 0; j < minibatch.size(); ++j) {
+      const SentenceView source = bitext.source(minibatch[j]);
+      const SentenceView target = bitext.target(minibatch[j]);
+      source_sentences[j].assign(source.begin(), source.end());
+      target_sentences[j].assign(target.begin(), target.end());
+      *word_count += target_sentences[j].size() - 1; // Minus one for <s>
+      tword_count += target_sentences[j].size() - 1; // Minus one for <s>
+    }
+
+    ComputationGraph hg;
+    if (minibatch.size() == 1) {
+      attentional_model.BuildGraph(source_sentences[0], target_sentences[0], hg);
+    }
+    else {
+      Expression batch_losses = attentional_model.BuildGraph(source_sentences, target_sentences, hg);
+      sum_batches(batch_losses);
+    }
+    double l = as_scalar(hg.forward());
+    *loss += l;
+    tloss += l;
+    hg.backward();
+    sgd->update(1.0 / minibatch.size());
+    if (after_minibatch) {
+      after_minibatch(i);
+    }
+
+    sentence_count += minibatch.size();
+    if (sentence_count / 50 != report_count) {
+      report_count = sentence_count / 50;
+      cerr << "--" << iteration << '.' << ((float)sentence_count * stride / bitext.size()) << " loss: " << tloss << " (perp=" << exp(tloss/tword_count) << ")" << endl;
+      tloss = 0;
+      tword_count = 0;
+    }
+    if (ctrlc_pressed) {
+      break;
+    }
+  }
+}
+
+// Hogwild-style asynchronous training. cnn supports only one ComputationGraph per
+// process, so each worker is a forked process rather than a thread. The parameters
+// live in shared memory (see the shared_parameters argument of cnn::Initialize),
+// so every worker builds its own graphs against the same Model and applies its
+// updates without any locking. Worker w trains on minibatches w, w + N, w + 2N, ...
+// first_minibatch is the position of minibatches in the epoch, which with noise_seed and
+// w gives each worker of each round its own negative samples.
+void TrainEpochHogwild(AttentionalModel& attentional_model, Trainer* sgd, const Bitext& bitext, const vector<vector<unsigned> >& minibatches,
+    unsigned worker_count, unsigned iteration, unsigned first_minibatch, unsigned noise_seed, double* loss, unsigned* word_count) {
+  vector<pid_t> workers(worker_count);
+  vector<int> result_fds(worker_count);
+  for (unsigned w = 0; w < worker_count; ++w) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      cerr << "ERROR: Unable to create pipe for worker " << w << endl;
+      exit(1);
+    }
+    workers[w] = fork();
+    if (workers[w] < 0) {
+      cerr << "ERROR: Unable to fork worker " << w << endl;
+      exit(1);
+    }
+    if (workers[w] == 0) {
+      close(fds[0]);
+      attentional_model.SeedNoise({noise_seed, w, iteration, first_minibatch});
+      double worker_loss = 0.0;
+      unsigned worker_word_count = 0;
+      TrainMinibatches(attentional_model, sgd, bitext, minibatches, w, minibatches.size(), worker_count, iteration, &worker_loss, &worker_word_count);
+      bool ok = write(fds[1], &worker_loss, sizeof(worker_loss)) == sizeof(worker_loss);
+      ok = ok && write(fds[1], &worker_word_count, sizeof(worker_word_count)) == sizeof(worker_word_count);
+      close(fds[1]);
+      _exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+    result_fds[w] = fds[0];
+  }
+
+  for (unsigned w = 0; w < worker_count; ++w) {
+    double worker_loss = 0.0;
+    unsigned worker_word_count = 0;
+    bool ok = read(result_fds[w], &worker_loss, sizeof(worker_loss)) == sizeof(worker_loss);
+    ok = ok && read(result_fds[w], &worker_word_count, sizeof(worker_word_count)) == sizeof(worker_word_count);
+    close(result_fds[w]);
+    int status;
+    waitpid(workers[w], &status, 0);
+    if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      cerr << "ERROR: Worker " << w << " failed" << endl;
+      exit(1);
+    }
+    *loss += worker_loss;
+    *word_count += worker_word_count;
+  }
+}
+
+// Synchronous training across several processes. Every process holds the same
+// shuffled minibatches (they all seed their RNG identically) and trains on its own
+// shard of them: process r takes minibatches r, r + N, r + 2N, ... After every
+// sync_every of its own minibatches, the processes average their parameters.
+void TrainEpochSynchronous(AttentionalModel& attentional_model, Model& model, Trainer* sgd, const Bitext& bitext, const vector<vector<unsigned> >& minibatches,
+    ParameterAverager& averager, unsigned sync_every, unsigned iteration, double* loss, unsigned* word_count) {
+  const unsigned world_size = averager.world_size;
+  // Every process must take part in the same number of synchronization rounds,
+  // even if its shard is one minibatch shorter than the others'.
+  const unsigned shard_size = (minibatches.size() + world_size - 1) / world_size;
+  for (unsigned start = 0; start < shard_size; start += sync_every) {
+    unsigned first = start * world_size + averager.rank;
+    unsigned last = min((start + sync_every) * world_size, (unsigned)minibatches.size());
+    TrainMinibatches(attentional_model, sgd, bitext, minibatches, first, last, world_size, iteration, loss, word_count);
+    ctrlc_pressed = averager.Average(model, ctrlc_pressed);
+    if (ctrlc_pressed) {
+      break;
+    }
+  }
+  *loss = averager.Sum(*loss);
+  *word_count = averager.Sum(*word_count);
+}
+
+// Adds how often each target word is predicted in bitext (everything after <s>) to *counts
+void CountTargetWords(const Bitext& bitext, vector<double>* counts) {
   for (unsigned i = 0; i < bitext.size(); ++i) {
-    source[i] = bitext.source_sentences[i];
-    target[i] = bitext.target_sentences[i];
+    const SentenceView target = bitext.target(i);
+    for (unsigned t = 1; t < target.size(); ++t) {
+      (*counts)[target[t]] += 1.0;
+    }
   }
-  bitext.source_sentences = source;
-  bitext.target_sentences = target;
 }
 
 void Serialize(Bitext& bitext, AttentionalModel& attentional_model, Model& model) {
@@ -73,6 +235,23 @@ int main(int argc, char** argv) {
     ("final_hidden_dim,f", po::value<unsigned>()->default_value(57), "Dimensionality of the hidden layer in the final FFNN")
     ("max_iteration", po::value<unsigned>()->default_value(100), "Max iterations for training")
     ("trainer", po::value<string>()->default_value("sgd"), "Trainer type: sgd, adagrad, adadelta, rmsprop, etc.")
+    ("minibatch_size,b", po::value<unsigned>()->default_value(1), "Number of sentence pairs per minibatch. Pairs are bucketed by source length.")
+    ("threads,j", po::value<unsigned>()->default_value(1), "Number of workers for asynchronous (Hogwild) training")
+    ("workers", po::value<unsigned>()->default_value(1), "Number of cooperating training processes that periodically average their parameters")
+    ("rank", po::value<unsigned>()->default_value(0), "Index of this process among --workers. Only rank 0 writes the model.")
+    ("sync_socket", po::value<string>()->default_value("/tmp/attentional_train.sock"), "Unix domain socket used by the --workers processes")
+    ("sync_every", po::value<unsigned>()->default_value(10), "Number of minibatches each worker trains on between parameter averaging")
+    ("checkpoint_prefix", po::value<string>(), "Write checkpoints to files starting with this prefix instead of rewriting stdout after every epoch")
+    ("checkpoint_every_sentences", po::value<unsigned>()->default_value(0), "Also checkpoint after this many sentence pairs (0 to disable; single process training only)")
+    ("checkpoint_every_seconds", po::value<unsigned>()->default_value(0), "Also checkpoint after this many seconds (0 to disable; single process training only)")
+    ("keep_checkpoints", po::value<unsigned>()->default_value(3), "Number of most recent checkpoints to keep")
+    ("resume", po::value<string>(), "Resume training from this checkpoint")
+    ("reader_threads", po::value<unsigned>()->default_value(0), "Number of threads parsing a text corpus (0 for one per core)")
+    ("stream", "Stream the corpus from disk in shuffled chunks instead of loading it into memory")
+    ("chunk_size", po::value<unsigned>()->default_value(100000), "Number of sentence pairs per chunk with --stream")
+    ("prefetch_chunks", po::value<unsigned>()->default_value(2), "Number of chunks read ahead of training with --stream")
+    ("softmax", po::value<string>()->default_value("full"), "Training objective over the target vocabulary: full, sampled (sampled softmax) or nce. With sampled or nce the reported perplexity is that of the sampled objective.")
+    ("negative_samples", po::value<unsigned>()->default_value(512), "Number of words drawn from the target unigram distribution per minibatch with --softmax sampled or nce")
     ;
   po::store(po::parse_command_line(argc, argv, opts), vm);
   po::notify(vm);
@@ -83,19 +262,121 @@ int main(int argc, char** argv) {
   }
   signal (SIGINT, ctrlc_handler);
 
+  // With --stream, bitext only holds the vocabularies. They come from the checkpoint
+  // when resuming and from a first pass over the corpus otherwise. Numberized corpora
+  // (see bin/numberize) are mmapped instead, which needs neither.
   const string corpus_filename = argv[1];
+  const unsigned reader_threads = (vm["reader_threads"].as<unsigned>() > 0) ? vm["reader_threads"].as<unsigned>() : max(thread::hardware_concurrency(), 1U);
+  const bool numberized = IsNumberizedCorpus(corpus_filename);
+  const bool stream = vm.count("stream") && !numberized;
   Bitext bitext;
-  ReadCorpus(corpus_filename, bitext, true);
-  cerr << "Read " << bitext.size() << " lines from " << corpus_filename << endl;
-  cerr << "Vocab size: " << bitext.source_vocab.size() << "/" << bitext.target_vocab.size() << endl; 
+  if (numberized) {
+    if (!MapCorpus(corpus_filename, bitext)) {
+      cerr << "ERROR: Unable to open " << corpus_filename << endl;
+      exit(1);
+    }
+    cerr << "Mapped " << bitext.size() << " lines from " << corpus_filename << endl;
+    cerr << "Vocab size: " << bitext.source_vocab.size() << "/" << bitext.target_vocab.size() << endl; 
+  }
+  else if (!stream) {
+    ReadCorpus(corpus_filename, bitext, true, reader_threads);
+    cerr << "Read " << bitext.size() << " lines from " << corpus_filename << endl;
+    cerr << "Vocab size: " << bitext.source_vocab.size() << "/" << bitext.target_vocab.size() << endl; 
+  }
+  else if (!vm.count("resume")) {
+    if (!ReadVocabulary(corpus_filename, bitext.source_vocab, bitext.target_vocab, true, reader_threads)) {
+      cerr << "ERROR: Unable to open " << corpus_filename << endl;
+      exit(1);
+    }
+    cerr << "Vocab size: " << bitext.source_vocab.size() << "/" << bitext.target_vocab.size() << endl; 
+  }
 
-  cnn::Initialize(argc, argv);
+  // Hogwild workers share the parameter memory, so it must be allocated as shared
+  const unsigned thread_count = vm["threads"].as<unsigned>();
+  const unsigned worker_count = vm["workers"].as<unsigned>();
+  const unsigned rank = vm["rank"].as<unsigned>();
+  if (thread_count > 1 && worker_count > 1) {
+    cerr << "ERROR: --threads and --workers cannot be combined" << endl;
+    exit(1);
+  }
+  if (rank >= worker_count) {
+    cerr << "ERROR: --rank must be less than --workers" << endl;
+    exit(1);
+  }
+  if (vm["keep_checkpoints"].as<unsigned>() == 0) {
+    cerr << "ERROR: --keep_checkpoints must be at least 1" << endl;
+    exit(1);
+  }
+  cnn::Initialize(argc, argv, 0, thread_count > 1);
   std::mt19937 rndeng(42);
 
   Model model;
   AttentionalModel attentional_model;
-  attentional_model.SetParams(vm);
-  attentional_model.Initialize(model, bitext.source_vocab.size(), bitext.target_vocab.size());
+  TrainingState training_state;
+  if (vm.count("resume")) {
+    // The model dimensions come from the checkpoint rather than the command line
+    const string resume_filename = vm["resume"].as<string>();
+    Dict source_vocab;
+    Dict target_vocab;
+    if (!LoadTrainingState(resume_filename, &training_state)) {
+      cerr << "ERROR: " << resume_filename << " is not a complete checkpoint" << endl;
+      exit(1);
+    }
+    if (!LoadModel(resume_filename, source_vocab, target_vocab, attentional_model, model, false)) {
+      cerr << "ERROR: Unable to open " << resume_filename << endl;
+      exit(1);
+    }
+    if (stream) {
+      bitext.source_vocab = source_vocab;
+      bitext.target_vocab = target_vocab;
+    }
+    else if (source_vocab.size() != bitext.source_vocab.size() || target_vocab.size() != bitext.target_vocab.size()) {
+      cerr << "ERROR: The vocabularies of " << resume_filename << " do not match " << corpus_filename << endl;
+      exit(1);
+    }
+    istringstream rng_state(training_state.rng_state);
+    rng_state >> rndeng;
+    cerr << "Resuming from iteration " << training_state.iteration << ", minibatch " << training_state.next_minibatch << endl;
+  }
+  else {
+    attentional_model.SetParams(vm);
+    attentional_model.Initialize(model, bitext.source_vocab.size(), bitext.target_vocab.size());
+  }
+
+  StreamingBitext* streaming_bitext = nullptr;
+  if (stream) {
+    streaming_bitext = new StreamingBitext(corpus_filename, bitext.source_vocab, bitext.target_vocab, true,
+        vm["chunk_size"].as<unsigned>(), vm["prefetch_chunks"].as<unsigned>());
+    if (!streaming_bitext->is_open()) {
+      cerr << "ERROR: Unable to read " << corpus_filename << endl;
+      exit(1);
+    }
+    cerr << "Streaming " << streaming_bitext->size() << " lines from " << corpus_filename << " in " << streaming_bitext->chunk_count() << " chunks" << endl;
+  }
+
+  // The sampled objectives draw their negatives from the unigram distribution of the target side
+  const string softmax_type = vm["softmax"].as<string>();
+  vector<double> target_counts;
+  if (softmax_type != "full") {
+    target_counts.resize(bitext.target_vocab.size(), 0.0);
+    if (streaming_bitext != nullptr) {
+      std::mt19937 count_rng(0);
+      Bitext chunk;
+      streaming_bitext->StartEpoch(count_rng);
+      while (streaming_bitext->NextChunk(&chunk)) {
+        CountTargetWords(chunk, &target_counts);
+      }
+    }
+    else {
+      CountTargetWords(bitext, &target_counts);
+    }
+    cerr << "Training with " << softmax_type << " softmax and " << vm["negative_samples"].as<unsigned>() << " negative samples" << endl;
+  }
+  attentional_model.SetTrainingObjective(softmax_type, vm["negative_samples"].as<unsigned>(), target_counts);
+  // Seeded from cnn's RNG (see --cnn-seed), this process's rank and where training starts,
+  // so that no two processes and no resumed run replay the same negatives
+  const unsigned noise_seed = (*cnn::rndeng)();
+  attentional_model.SeedNoise({noise_seed, rank, training_state.iteration, training_state.next_minibatch});
 
   Trainer* sgd = nullptr;
   string trainertype(vm["trainer"].as<string>());
@@ -123,52 +404,118 @@ int main(int argc, char** argv) {
     exit(1);
   }
   sgd->eta_decay = 0.05;
+  if (vm.count("resume")) {
+    RestoreTrainerState(training_state, sgd);
+  }
+  if (thread_count > 1) {
+    // Trainers allocate their per-parameter state on the first update. Do that here,
+    // with a zero step, so the workers forked later all share the same state.
+    sgd->update(0.0);
+  }
+
+  ParameterAverager* averager = nullptr;
+  if (worker_count > 1) {
+    averager = new ParameterAverager(vm["sync_socket"].as<string>(), rank, worker_count);
+    // Start every process from rank 0's initialization
+    averager->Broadcast(model);
+  }
+  const bool write_model = (rank == 0);
+  Checkpointer* checkpointer = nullptr;
+  if (write_model && vm.count("checkpoint_prefix")) {
+    checkpointer = new Checkpointer(vm["checkpoint_prefix"].as<string>(), vm["keep_checkpoints"].as<unsigned>(),
+        vm["checkpoint_every_sentences"].as<unsigned>(), vm["checkpoint_every_seconds"].as<unsigned>());
+  }
 
   cerr << "Training model...\n";
-  unsigned minibatch_count = 0;
-  const unsigned minibatch_size = 1;
-  for (unsigned iteration = 0; iteration < vm["max_iteration"].as<unsigned>() || false; iteration++) {
+  const unsigned minibatch_size = vm["minibatch_size"].as<unsigned>();
+  for (unsigned iteration = training_state.iteration; iteration < vm["max_iteration"].as<unsigned>() || false; iteration++) {
     Timer iteration_timer("time:");
     unsigned word_count = 0;
-    unsigned tword_count = 0;
-    shuffle(bitext, rndeng);
+    ostringstream rng_state;
+    rng_state << rndeng;
+    training_state.rng_state = rng_state.str();
+    training_state.iteration = iteration;
+
+    // Trains on all of bitext, or on one chunk of it when streaming. next_minibatch counts
+    // minibatches from the start of the epoch, across chunks. When resuming in the middle
+    // of an epoch, the minibatches already trained on are still built (to replay the RNG)
+    // but skipped.
+    const unsigned resume_minibatch = training_state.next_minibatch;
+    unsigned epoch_minibatch = 0;
     double loss = 0.0;
-    double tloss = 0.0;
-    for (unsigned i = 0; i < bitext.size(); ++i) {
-      //cerr << "Reading sentence pair #" << i << endl;
-      vector<WordId> source_sentence = bitext.source_sentences[i];
-      vector<WordId> target_sentence = bitext.target_sentences[i];
-      word_count += bitext.target_sentences[i].size() - 1; // Minus one for <s>
-      tword_count += bitext.target_sentences[i].size() - 1; // Minus one for <s>
-      ComputationGraph hg;
-      attentional_model.BuildGraph(source_sentence, target_sentence, hg);
-      double l = as_scalar(hg.forward());
-      loss += l;
-      tloss += l;
-      hg.backward();
-      if (i % 50 == 0) {
-        cerr << "--" << iteration << '.' << ((float)i / bitext.size()) << " loss: " << tloss << " (perp=" << exp(tloss/tword_count) << ")" << endl;
-        tloss = 0;
-        tword_count = 0;
+    auto train_on = [&](const Bitext& data) {
+      vector<vector<unsigned> > minibatches = MakeMinibatches(data, minibatch_size, rndeng);
+      const unsigned skip = min(resume_minibatch - min(resume_minibatch, epoch_minibatch), (unsigned)minibatches.size());
+      minibatches.erase(minibatches.begin(), minibatches.begin() + skip);
+      const unsigned first_minibatch = epoch_minibatch + skip;
+      epoch_minibatch += skip + minibatches.size();
+      training_state.next_minibatch = first_minibatch;
+      auto after_minibatch = [&](unsigned i) {
+        training_state.next_minibatch = first_minibatch + i + 1;
+        if (checkpointer != nullptr && checkpointer->Tick(minibatches[i].size())) {
+          SaveTrainerState(*sgd, &training_state);
+          checkpointer->Save(bitext.source_vocab, bitext.target_vocab, attentional_model, model, training_state);
+        }
+      };
+
+      double data_loss = 0.0;
+      unsigned data_word_count = 0;
+      if (averager != nullptr) {
+        TrainEpochSynchronous(attentional_model, model, sgd, data, minibatches, *averager, vm["sync_every"].as<unsigned>(), iteration, &data_loss, &data_word_count);
       }
-      if (++minibatch_count == minibatch_size) {
-        sgd->update(1.0 / minibatch_size);
-        minibatch_count = 0;
+      else if (thread_count > 1) {
+        TrainEpochHogwild(attentional_model, sgd, data, minibatches, thread_count, iteration, first_minibatch, noise_seed, &data_loss, &data_word_count);
       }
-      if (ctrlc_pressed) {
-        break;
+      else {
+        TrainMinibatches(attentional_model, sgd, data, minibatches, 0, minibatches.size(), 1, iteration, &data_loss, &data_word_count, after_minibatch);
       }
+      loss += data_loss;
+      word_count += data_word_count;
+    };
+
+    if (streaming_bitext != nullptr) {
+      streaming_bitext->StartEpoch(rndeng);
+      Bitext chunk;
+      while (!ctrlc_pressed && streaming_bitext->NextChunk(&chunk)) {
+        train_on(chunk);
+      }
+    }
+    else {
+      train_on(bitext);
     }
     if (ctrlc_pressed) {
+      if (checkpointer != nullptr && thread_count == 1 && averager == nullptr) {
+        SaveTrainerState(*sgd, &training_state);
+        checkpointer->Save(bitext.source_vocab, bitext.target_vocab, attentional_model, model, training_state);
+      }
       break;
     }
 
     cerr << "Iteration " << iteration << " loss: " << loss << " (perp=" << exp(loss/word_count) << ")" << endl;
     sgd->update_epoch();
-    Serialize(bitext, attentional_model, model);
+    if (checkpointer != nullptr) {
+      // The next epoch starts from the RNG's current state
+      ostringstream next_rng_state;
+      next_rng_state << rndeng;
+      training_state.rng_state = next_rng_state.str();
+      training_state.iteration = iteration + 1;
+      training_state.next_minibatch = 0;
+      SaveTrainerState(*sgd, &training_state);
+      checkpointer->Save(bitext.source_vocab, bitext.target_vocab, attentional_model, model, training_state);
+    }
+    else if (write_model) {
+      Serialize(bitext, attentional_model, model);
+    }
+    training_state.next_minibatch = 0;
   }
 
-  Serialize(bitext, attentional_model, model);
+  // With checkpoints, the final model is the last checkpoint rather than stdout
+  if (write_model && checkpointer == nullptr) {
+    Serialize(bitext, attentional_model, model);
+  }
+  delete checkpointer;
+  delete streaming_bitext;
+  delete averager;
   delete sgd;
   return 0;
 }
@@ -8,6 +8,7 @@
 #include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/regex.hpp>
+#include <boost/utility/string_ref.hpp>
 
 using namespace std;
 
@@ -85,6 +86,74 @@ vector<string> strip(vector<string> input) {
   return output;
 }
 
+// Zero-copy parsing for the per-line input of the command line tools. The string_refs
+// below point into the input, which must outlive them. Output vectors are cleared and
+// refilled, so reusing one vector across lines stops allocating once it is big enough.
+
+inline boost::string_ref strip_view(boost::string_ref input) {
+  size_t start = 0;
+  size_t end = input.size();
+  while (start < end && isspace((unsigned char)input[start])) {
+    ++start;
+  }
+  while (end > start && isspace((unsigned char)input[end - 1])) {
+    --end;
+  }
+  return input.substr(start, end - start);
+}
+
+// Splits a line into fields at each delimiter (e.g. "|||") and strips every field.
+// Empty fields are kept, so field i always means the same column.
+inline void split_fields(boost::string_ref line, boost::string_ref delimiter, vector<boost::string_ref>* fields) {
+  fields->clear();
+  size_t next;
+  while ((next = line.find(delimiter)) != boost::string_ref::npos) {
+    fields->push_back(strip_view(line.substr(0, next)));
+    line.remove_prefix(next + delimiter.size());
+  }
+  fields->push_back(strip_view(line));
+}
+
+// Splits text into words at runs of whitespace, the same way the training corpus reader does.
+inline void split_words(boost::string_ref text, vector<boost::string_ref>* words) {
+  words->clear();
+  size_t i = 0;
+  while (i < text.size()) {
+    while (i < text.size() && isspace((unsigned char)text[i])) {
+      ++i;
+    }
+    size_t start = i;
+    while (i < text.size() && !isspace((unsigned char)text[i])) {
+      ++i;
+    }
+    if (i > start) {
+      words->push_back(text.substr(start, i - start));
+    }
+  }
+}
+
+inline string join_words(const vector<boost::string_ref>& words, const string& separator = " ") {
+  string output;
+  for (unsigned i = 0; i < words.size(); ++i) {
+    if (i > 0) {
+      output += separator;
+    }
+    output.append(words[i].data(), words[i].size());
+  }
+  return output;
+}
+
+// Appends the id of each word to *ids. Dict::Convert takes a string, so the words are
+// copied into one reused buffer rather than into a new string each.
+template <class Vocab, class Id>
+void convert_words(const vector<boost::string_ref>& words, Vocab& vocab, vector<Id>* ids) {
+  string word;
+  for (boost::string_ref w : words) {
+    word.assign(w.data(), w.size());
+    ids->push_back(vocab.Convert(word));
+  }
+}
+
 map<string, double> parse_feature_string(string input) {
   map<string, double> output;
   for (string piece : tokenize(input, " ")) {
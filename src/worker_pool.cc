@@ -0,0 +1,118 @@
+#include <iostream>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "worker_pool.h"
+
+void WriteMessage(int fd, const string& message) {
+  uint32_t length = message.size();
+  const char* header = (const char*)&length;
+  string data(header, header + sizeof(length));
+  data += message;
+  const char* p = data.data();
+  size_t remaining = data.size();
+  while (remaining > 0) {
+    ssize_t n = write(fd, p, remaining);
+    if (n <= 0) {
+      cerr << "ERROR: Lost connection to a worker process" << endl;
+      exit(1);
+    }
+    p += n;
+    remaining -= n;
+  }
+}
+
+bool ReadMessage(int fd, string* message) {
+  uint32_t length;
+  char* header = (char*)&length;
+  size_t got = 0;
+  while (got < sizeof(length)) {
+    ssize_t n = read(fd, header + got, sizeof(length) - got);
+    if (n <= 0) {
+      return false;
+    }
+    got += n;
+  }
+  message->resize(length);
+  got = 0;
+  while (got < length) {
+    ssize_t n = read(fd, &(*message)[got], length - got);
+    if (n <= 0) {
+      return false;
+    }
+    got += n;
+  }
+  return true;
+}
+
+void RunWorkers(unsigned worker_count, const function<bool(string*)>& next_input,
+    const function<string(const string&, unsigned)>& process, const function<void(const string&)>& output) {
+  vector<int> to_worker(worker_count);
+  vector<int> from_worker(worker_count);
+  vector<pid_t> workers(worker_count);
+  for (unsigned w = 0; w < worker_count; ++w) {
+    int in_fds[2], out_fds[2];
+    if (pipe(in_fds) != 0 || pipe(out_fds) != 0) {
+      cerr << "ERROR: Unable to create pipes for worker " << w << endl;
+      exit(1);
+    }
+    workers[w] = fork();
+    if (workers[w] < 0) {
+      cerr << "ERROR: Unable to fork worker " << w << endl;
+      exit(1);
+    }
+    if (workers[w] == 0) {
+      // Close the pipes of the workers forked before this one, as well as the parent's ends
+      for (unsigned v = 0; v < w; ++v) {
+        close(to_worker[v]);
+        close(from_worker[v]);
+      }
+      close(in_fds[1]);
+      close(out_fds[0]);
+      string input;
+      for (unsigned input_id = w; ReadMessage(in_fds[0], &input); input_id += worker_count) {
+        WriteMessage(out_fds[1], process(input, input_id));
+      }
+      _exit(0);
+    }
+    close(in_fds[0]);
+    close(out_fds[1]);
+    to_worker[w] = in_fds[1];
+    from_worker[w] = out_fds[0];
+  }
+
+  const unsigned max_in_flight = 2 * worker_count;
+  unsigned next_input_id = 0;
+  unsigned next_output_id = 0;
+  string input;
+  string result;
+  bool input_done = false;
+  while (!input_done || next_output_id < next_input_id) {
+    while (!input_done && next_input_id - next_output_id < max_in_flight) {
+      if (next_input(&input)) {
+        WriteMessage(to_worker[next_input_id % worker_count], input);
+        ++next_input_id;
+      }
+      else {
+        input_done = true;
+      }
+    }
+    if (next_output_id < next_input_id) {
+      if (!ReadMessage(from_worker[next_output_id % worker_count], &result)) {
+        cerr << "ERROR: Worker " << next_output_id % worker_count << " exited unexpectedly" << endl;
+        exit(1);
+      }
+      output(result);
+      ++next_output_id;
+    }
+  }
+
+  for (unsigned w = 0; w < worker_count; ++w) {
+    close(to_worker[w]);
+    close(from_worker[w]);
+    waitpid(workers[w], NULL, 0);
+  }
+}
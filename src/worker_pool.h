@@ -0,0 +1,18 @@
+#pragma once
+#include <string>
+#include <functional>
+
+using namespace std;
+
+// Messages between a process and its worker processes are a length followed by that many bytes
+void WriteMessage(int fd, const string& message);
+bool ReadMessage(int fd, string* message);
+
+// cnn supports one ComputationGraph per process, so tools that decode or score in
+// parallel fork worker processes, which share the loaded model copy-on-write.
+// Inputs come from next_input until it returns false. Input i goes to worker
+// i % worker_count, which returns process(input, i), and the results are handed to
+// output in input order. A bounded number of inputs is kept in flight so that
+// neither side blocks on a full pipe.
+void RunWorkers(unsigned worker_count, const function<bool(string*)>& next_input,
+    const function<string(const string&, unsigned)>& process, const function<void(const string&)>& output);